@@ -0,0 +1,75 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "vec.h"
+#include <algorithm>
+#include <limits>
+
+struct AABB {
+    Vec min;
+    Vec max;
+
+    // An empty box, ready to be grown with expand()
+    AABB() :
+        min( std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() ),
+        max( -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() ) { }
+    AABB( const Vec& min, const Vec& max ) : min( min ), max( max ) { }
+
+    void expand( const Vec& p ) {
+        min = Vec( std::min( min.x, p.x ), std::min( min.y, p.y ), std::min( min.z, p.z ) );
+        max = Vec( std::max( max.x, p.x ), std::max( max.y, p.y ), std::max( max.z, p.z ) );
+    }
+
+    void expand( const AABB& b ) {
+        min = Vec( std::min( min.x, b.min.x ), std::min( min.y, b.min.y ), std::min( min.z, b.min.z ) );
+        max = Vec( std::max( max.x, b.max.x ), std::max( max.y, b.max.y ), std::max( max.z, b.max.z ) );
+    }
+
+    bool empty() const {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
+    Vec center() const {
+        return ( min + max ) * 0.5f;
+    }
+
+    Vec extent() const {
+        return max - min;
+    }
+
+    float axis_min( int axis ) const { return axis == 0 ? min.x : ( axis == 1 ? min.y : min.z ); }
+    float axis_max( int axis ) const { return axis == 0 ? max.x : ( axis == 1 ? max.y : max.z ); }
+
+    float surface_area() const {
+        if ( empty() ) return 0.0f;
+        Vec d = extent();
+        return 2.0f * ( d.x * d.y + d.y * d.z + d.z * d.x );
+    }
+
+    // Slab test. inv_dir is 1 / ray.direction per component; the NaNs produced
+    // by 0 * inf fail every comparison below and so never reject a box.
+    bool intersect( const Vec& origin, const Vec& inv_dir, float t_min, float t_max, float& t_entry ) const {
+        float tx0 = ( min.x - origin.x ) * inv_dir.x;
+        float tx1 = ( max.x - origin.x ) * inv_dir.x;
+        if ( tx0 > tx1 ) std::swap( tx0, tx1 );
+        if ( tx0 > t_min ) t_min = tx0;
+        if ( tx1 < t_max ) t_max = tx1;
+
+        float ty0 = ( min.y - origin.y ) * inv_dir.y;
+        float ty1 = ( max.y - origin.y ) * inv_dir.y;
+        if ( ty0 > ty1 ) std::swap( ty0, ty1 );
+        if ( ty0 > t_min ) t_min = ty0;
+        if ( ty1 < t_max ) t_max = ty1;
+
+        float tz0 = ( min.z - origin.z ) * inv_dir.z;
+        float tz1 = ( max.z - origin.z ) * inv_dir.z;
+        if ( tz0 > tz1 ) std::swap( tz0, tz1 );
+        if ( tz0 > t_min ) t_min = tz0;
+        if ( tz1 < t_max ) t_max = tz1;
+
+        t_entry = t_min;
+        return t_min <= t_max;
+    }
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "vec.h"
+#include "camera.h"
+#include "transform.h"
+#include <vector>
+#include <cstddef>
+
+// One step of a <transform> element. Rotations keep their angle in value.x.
+struct TransformOp {
+    enum Type {
+        TRANSLATE,
+        SCALE,
+        ROTATE_X,
+        ROTATE_Y,
+        ROTATE_Z
+    };
+
+    Type type;
+    Vec value;
+
+    // Composes the steps in order, as the scene file lists them
+    static Transform compose( const std::vector<TransformOp>& ops ) {
+        Transform result;
+        for ( const TransformOp& op : ops ) {
+            switch ( op.type ) {
+            case TRANSLATE: result = result * Transform::translate( op.value ); break;
+            case SCALE:     result = result * Transform::scale( op.value ); break;
+            case ROTATE_X:  result = result * Transform::rotateX( op.value.x ); break;
+            case ROTATE_Y:  result = result * Transform::rotateY( op.value.x ); break;
+            case ROTATE_Z:  result = result * Transform::rotateZ( op.value.x ); break;
+            }
+        }
+        return result;
+    }
+};
+
+struct CameraKey {
+    int frame;
+    Vec position;
+    Vec look_at;
+    Vec up;
+    float fov;
+};
+
+struct TransformKey {
+    int frame;
+    std::vector<TransformOp> ops;
+};
+
+// Keyframes of one object's transform
+struct ObjectTrack {
+    size_t object;
+    std::vector<TransformKey> keys;
+};
+
+// Keyframed camera and object transforms over frames [0, frame_count).
+// Between two keys the values are interpolated linearly: camera vectors and
+// fov directly, transforms step by step, so a rotation key interpolates its
+// angle rather than the matrix. Two transform keys whose steps differ in
+// type or number can't be blended; the earlier one holds until the next.
+// Before the first key and after the last one the nearest key holds. Keys
+// are sorted by frame.
+class Animation {
+public:
+    int frame_count = 0;
+    std::vector<CameraKey> camera_keys;
+    std::vector<ObjectTrack> object_tracks;
+
+    // base is the camera the scene file describes; its resolution is kept
+    Camera camera_at( int frame, const Camera& base ) const {
+        Camera camera = base;
+        if ( camera_keys.empty() ) {
+            return camera;
+        }
+        size_t k0, k1;
+        float t = find_keys( camera_keys, frame, k0, k1 );
+        const CameraKey& a = camera_keys[k0];
+        const CameraKey& b = camera_keys[k1];
+        camera.position = lerp( a.position, b.position, t );
+        camera.look_at = lerp( a.look_at, b.look_at, t );
+        camera.up = lerp( a.up, b.up, t );
+        camera.fov = a.fov + ( b.fov - a.fov ) * t;
+        return camera;
+    }
+
+    static Transform transform_at( const ObjectTrack& track, int frame ) {
+        size_t k0, k1;
+        float t = find_keys( track.keys, frame, k0, k1 );
+        const std::vector<TransformOp>& a = track.keys[k0].ops;
+        const std::vector<TransformOp>& b = track.keys[k1].ops;
+        if ( !same_steps( a, b ) ) {
+            return TransformOp::compose( a );
+        }
+        std::vector<TransformOp> ops = a;
+        for ( size_t i = 0; i < ops.size(); i++ ) {
+            ops[i].value = lerp( a[i].value, b[i].value, t );
+        }
+        return TransformOp::compose( ops );
+    }
+
+private:
+    // The keys around frame and the blend factor between them
+    template <typename Key>
+    static float find_keys( const std::vector<Key>& keys, int frame, size_t& k0, size_t& k1 ) {
+        k0 = k1 = 0;
+        while ( k1 + 1 < keys.size() && keys[k1].frame < frame ) {
+            k0 = k1++;
+        }
+        if ( keys[k1].frame <= frame || k0 == k1 ) {
+            k0 = k1;
+            return 0.0f;
+        }
+        return (float)( frame - keys[k0].frame ) / (float)( keys[k1].frame - keys[k0].frame );
+    }
+
+    static bool same_steps( const std::vector<TransformOp>& a, const std::vector<TransformOp>& b ) {
+        if ( a.size() != b.size() ) {
+            return false;
+        }
+        for ( size_t i = 0; i < a.size(); i++ ) {
+            if ( a[i].type != b[i].type ) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static Vec lerp( const Vec& a, const Vec& b, float t ) {
+        return a + ( b - a ) * t;
+    }
+};
+
+#endif
@@ -0,0 +1,631 @@
+#include "bvh.h"
+#include "thread_pool.h"
+#include <cmath>
+
+namespace {
+
+// Subtrees with more primitives than this are built in a task of their own
+const uint32_t parallel_subtree_size = 1 << 15;
+// Treelet restructuring hands out tasks down to this depth
+const int parallel_treelet_depth = 6;
+// Leaves of one treelet; 7 is the usual choice (3^7 subset pairs to check)
+const int treelet_leaves = 7;
+
+// Picks the grid of one axis of a wide node: the smallest power of two step
+// for which 255 steps from lo still reach hi
+int8_t grid_exponent( float lo, float hi ) {
+    int e;
+    std::frexp( ( hi - lo ) / 255.0f, &e );
+    e = std::max( e, -126 );
+    while ( e < 127 && lo + 255.0f * std::ldexp( 1.0f, e ) < hi ) {
+        e++;
+    }
+    return (int8_t)e;
+}
+
+// Sets the grid of a wide node to box and stores its children's boxes on it,
+// rounded outwards
+void quantize_children( WideBVHNode& node, const AABB& box, const AABB* child_boxes ) {
+    for ( int axis = 0; axis < 3; axis++ ) {
+        node.origin[axis] = box.axis_min( axis );
+        node.exponent[axis] = grid_exponent( box.axis_min( axis ), box.axis_max( axis ) );
+    }
+
+    for ( int k = 0; k < node.child_count; k++ ) {
+        const AABB& child = child_boxes[k];
+        for ( int axis = 0; axis < 3; axis++ ) {
+            float step = node.scale( axis );
+            float q_lo = std::floor( ( child.axis_min( axis ) - node.origin[axis] ) / step );
+            float q_hi = std::ceil( ( child.axis_max( axis ) - node.origin[axis] ) / step );
+            node.lo[axis][k] = (uint8_t)std::max( 0.0f, std::min( 255.0f, q_lo ) );
+            node.hi[axis][k] = (uint8_t)std::max( 0.0f, std::min( 255.0f, q_hi ) );
+        }
+        // Here I correct for rounding in the division, checking against the
+        // planes exactly as traversal computes them
+        for ( int axis = 0; axis < 3; axis++ ) {
+            while ( node.lo[axis][k] > 0 && node.child_bounds( k ).axis_min( axis ) > child.axis_min( axis ) ) {
+                node.lo[axis][k]--;
+            }
+            while ( node.hi[axis][k] < 255 && node.child_bounds( k ).axis_max( axis ) < child.axis_max( axis ) ) {
+                node.hi[axis][k]++;
+            }
+        }
+    }
+}
+
+bool finite_box( const AABB& box ) {
+    return std::isfinite( box.min.x ) && std::isfinite( box.min.y ) && std::isfinite( box.min.z ) &&
+           std::isfinite( box.max.x ) && std::isfinite( box.max.y ) && std::isfinite( box.max.z );
+}
+
+// Runs fn( i ) for i in [0, count), on the pool if there is one
+void for_each( ThreadPool* pool, int count, const std::function<void( int )>& fn ) {
+    if ( pool && count > 1 ) {
+        pool->parallel_for( count, fn );
+    } else {
+        for ( int i = 0; i < count; i++ ) {
+            fn( i );
+        }
+    }
+}
+
+// Spreads the low 21 bits of v out to every third bit
+uint64_t expand_bits( uint32_t v ) {
+    uint64_t x = v & 0x1FFFFFu;
+    x = ( x | x << 32 ) & 0x1F00000000FFFFull;
+    x = ( x | x << 16 ) & 0x1F0000FF0000FFull;
+    x = ( x | x << 8 ) & 0x100F00F00F00F00Full;
+    x = ( x | x << 4 ) & 0x10C30C30C30C30C3ull;
+    x = ( x | x << 2 ) & 0x1249249249249249ull;
+    return x;
+}
+
+// Stable LSD radix sort of keys with values alongside, 8 bits per pass. Each
+// pass counts digits per block in parallel, then every block scatters its
+// keys to the offsets the prefix sum gave it. Passes where all keys share the
+// digit are skipped.
+void radix_sort( std::vector<uint64_t>& keys, std::vector<uint32_t>& values, ThreadPool* pool ) {
+    size_t n = keys.size();
+    int blocks = pool && n > parallel_subtree_size ? pool->size() * 4 : 1;
+    size_t block_size = ( n + blocks - 1 ) / blocks;
+    std::vector<uint64_t> key_buffer( n );
+    std::vector<uint32_t> value_buffer( n );
+    std::vector<size_t> offsets( (size_t)blocks * 256 );
+
+    for ( int shift = 0; shift < 64; shift += 8 ) {
+        for_each( pool, blocks, [&]( int b ) {
+            size_t* count = &offsets[(size_t)b * 256];
+            std::fill( count, count + 256, 0 );
+            size_t end = std::min( n, ( b + 1 ) * block_size );
+            for ( size_t i = b * block_size; i < end; i++ ) {
+                count[( keys[i] >> shift ) & 0xFF]++;
+            }
+        } );
+
+        // Here I turn the counts into start offsets, digit by digit and
+        // within a digit block by block, which keeps the sort stable
+        size_t sum = 0;
+        bool single_digit = false;
+        for ( int digit = 0; digit < 256; digit++ ) {
+            size_t digit_start = sum;
+            for ( int b = 0; b < blocks; b++ ) {
+                size_t count = offsets[(size_t)b * 256 + digit];
+                offsets[(size_t)b * 256 + digit] = sum;
+                sum += count;
+            }
+            single_digit = single_digit || sum - digit_start == n;
+        }
+        if ( single_digit ) {
+            continue;
+        }
+
+        for_each( pool, blocks, [&]( int b ) {
+            size_t* offset = &offsets[(size_t)b * 256];
+            size_t end = std::min( n, ( b + 1 ) * block_size );
+            for ( size_t i = b * block_size; i < end; i++ ) {
+                size_t to = offset[( keys[i] >> shift ) & 0xFF]++;
+                key_buffer[to] = keys[i];
+                value_buffer[to] = values[i];
+            }
+        } );
+        keys.swap( key_buffer );
+        values.swap( value_buffer );
+    }
+}
+
+int popcount( uint32_t x ) {
+    int count = 0;
+    for ( ; x; x &= x - 1 ) count++;
+    return count;
+}
+
+int lowest_bit( uint32_t x ) {
+    int bit = 0;
+    while ( !( x & 1 ) ) {
+        x >>= 1;
+        bit++;
+    }
+    return bit;
+}
+
+uint64_t highest_bit( uint64_t x ) {
+    for ( int shift = 1; shift < 64; shift *= 2 ) {
+        x |= x >> shift;
+    }
+    return x ^ ( x >> 1 );
+}
+
+}
+
+void BVH::build_lbvh( const std::vector<AABB>& prim_bounds, ThreadPool* pool, int max_leaf_size, int leaf_block,
+                      int treelet_passes ) {
+    leaf_size_limit = (uint32_t)std::max( 1, max_leaf_size );
+    block_size = (uint32_t)std::max( 1, leaf_block );
+    size_t n = prim_bounds.size();
+    if ( n == 0 ) {
+        nodes.clear();
+        prim_indices.clear();
+        return;
+    }
+
+    // Here I compute 63-bit Morton codes of the centroids, quantized to 21
+    // bits per axis within the centroid bounds
+    int blocks = pool && n > parallel_subtree_size ? pool->size() * 4 : 1;
+    size_t block_size_prims = ( n + blocks - 1 ) / blocks;
+    std::vector<AABB> block_bounds( blocks );
+    for_each( pool, blocks, [&]( int b ) {
+        size_t end = std::min( n, ( b + 1 ) * block_size_prims );
+        for ( size_t i = b * block_size_prims; i < end; i++ ) {
+            block_bounds[b].expand( prim_bounds[i].center() );
+        }
+    } );
+    AABB centroid_bounds;
+    for ( const AABB& box : block_bounds ) {
+        centroid_bounds.expand( box );
+    }
+
+    // The grid cells are cubes: stretching a flat axis to the full 21 bits
+    // would make the top splits cut along it
+    const float grid = (float)( ( 1 << 21 ) - 1 );
+    Vec extent = centroid_bounds.extent();
+    float max_extent = std::max( extent.x, std::max( extent.y, extent.z ) );
+    float cell_scale = max_extent > 0.0f ? grid / max_extent : 0.0f;
+    Vec scale( cell_scale, cell_scale, cell_scale );
+    std::vector<uint64_t> codes( n );
+    build_indices.resize( n );
+    for_each( pool, blocks, [&]( int b ) {
+        size_t end = std::min( n, ( b + 1 ) * block_size_prims );
+        for ( size_t i = b * block_size_prims; i < end; i++ ) {
+            Vec c = prim_bounds[i].center() - centroid_bounds.min;
+            uint32_t qx = (uint32_t)std::min( grid, std::max( 0.0f, c.x * scale.x ) );
+            uint32_t qy = (uint32_t)std::min( grid, std::max( 0.0f, c.y * scale.y ) );
+            uint32_t qz = (uint32_t)std::min( grid, std::max( 0.0f, c.z * scale.z ) );
+            codes[i] = expand_bits( qx ) << 2 | expand_bits( qy ) << 1 | expand_bits( qz );
+            build_indices[i] = (uint32_t)i;
+        }
+    } );
+    radix_sort( codes, build_indices, pool );
+
+    // Here I emit the hierarchy. The subtree of a range of c primitives gets
+    // a fixed block of 2c - 1 node slots, so subtrees can be built in
+    // parallel without coordinating; compact_lbvh() then drops the unused
+    // slots and lays the nodes out in the order build() would.
+    std::vector<BVHNode> sparse( 2 * n - 1 );
+    build_nodes.swap( sparse );
+    emit_lbvh( prim_bounds, codes, 0, 1, 0, (uint32_t)n, 1, pool );
+    build_nodes.swap( sparse );
+    build_nodes.clear();
+    build_nodes.reserve( 2 * n - 1 );
+    build_nodes.push_back( sparse[0] );
+    compact_lbvh( sparse, 0, 0 );
+    sparse = std::vector<BVHNode>();
+    codes = std::vector<uint64_t>();
+
+    std::vector<float> cost( build_nodes.size() );
+    std::vector<uint8_t> height( build_nodes.size() );
+    for ( int pass = 0; pass < treelet_passes; pass++ ) {
+        restructure_treelets( 0, cost, height, 0, pool );
+    }
+    if ( treelet_passes > 0 ) {
+        // Rewired treelets reuse their old node pairs in whatever order, so a
+        // child can end up before its parent. Here I lay the nodes out again
+        // depth-first, as view() and refit() expect.
+        sparse.swap( build_nodes );
+        build_nodes.clear();
+        build_nodes.push_back( sparse[0] );
+        compact_lbvh( sparse, 0, 0 );
+        sparse = std::vector<BVHNode>();
+    }
+
+    build_nodes.shrink_to_fit();
+    nodes.assign( std::move( build_nodes ) );
+    prim_indices.assign( std::move( build_indices ) );
+    build_nodes = std::vector<BVHNode>();
+    build_indices = std::vector<uint32_t>();
+}
+
+AABB BVH::emit_lbvh( const std::vector<AABB>& prim_bounds, const std::vector<uint64_t>& codes, uint32_t slot,
+                     uint32_t region, uint32_t first, uint32_t count, int depth, ThreadPool* pool ) {
+    BVHNode& node = build_nodes[slot];
+    node.left_first = first;
+    node.count = count;
+    node.bounds = AABB();
+    if ( count == 1 || depth >= max_depth ) {
+        for ( uint32_t i = 0; i < count; i++ ) {
+            node.bounds.expand( prim_bounds[build_indices[first + i]] );
+        }
+        return node.bounds;
+    }
+
+    // Here I split where the highest bit that differs within the range flips,
+    // or in the middle if all codes are equal
+    uint32_t last = first + count - 1;
+    uint64_t differing = codes[first] ^ codes[last];
+    uint32_t mid = first + count / 2;
+    if ( differing != 0 ) {
+        uint64_t bit = highest_bit( differing );
+        mid = (uint32_t)( std::partition_point( codes.begin() + first, codes.begin() + last + 1,
+                                                [bit]( uint64_t code ) { return !( code & bit ); } ) - codes.begin() );
+    }
+
+    // Small ranges become leaves when the SAH says a split doesn't pay off
+    if ( count <= leaf_size_limit ) {
+        AABB left_box, right_box;
+        for ( uint32_t i = first; i < mid; i++ ) {
+            left_box.expand( prim_bounds[build_indices[i]] );
+        }
+        for ( uint32_t i = mid; i <= last; i++ ) {
+            right_box.expand( prim_bounds[build_indices[i]] );
+        }
+        node.bounds = left_box;
+        node.bounds.expand( right_box );
+        float parent_area = node.bounds.surface_area();
+        float leaf_cost = blocks( count );
+        float split_cost = parent_area > 0.0f
+            ? traversal_cost + ( blocks( mid - first ) * left_box.surface_area() + blocks( last + 1 - mid ) * right_box.surface_area() ) / parent_area
+            : leaf_cost;
+        if ( split_cost >= leaf_cost ) {
+            return node.bounds;
+        }
+    }
+
+    uint32_t left_count = mid - first;
+    uint32_t right_count = count - left_count;
+    node.left_first = region;
+    node.count = 0;
+
+    AABB left_box, right_box;
+    uint32_t left_region = region + 2;
+    uint32_t right_region = region + 2 * left_count;
+    if ( pool && left_count > parallel_subtree_size && right_count > parallel_subtree_size ) {
+        TaskGroup group( *pool );
+        group.run( [&] {
+            left_box = emit_lbvh( prim_bounds, codes, region, left_region, first, left_count, depth + 1, pool );
+        } );
+        right_box = emit_lbvh( prim_bounds, codes, region + 1, right_region, mid, right_count, depth + 1, pool );
+        group.wait();
+    } else {
+        left_box = emit_lbvh( prim_bounds, codes, region, left_region, first, left_count, depth + 1, pool );
+        right_box = emit_lbvh( prim_bounds, codes, region + 1, right_region, mid, right_count, depth + 1, pool );
+    }
+
+    node.bounds = left_box;
+    node.bounds.expand( right_box );
+    return node.bounds;
+}
+
+void BVH::compact_lbvh( const std::vector<BVHNode>& sparse, uint32_t old_index, uint32_t new_index ) {
+    const BVHNode& node = sparse[old_index];
+    if ( node.is_leaf() ) {
+        return;
+    }
+    uint32_t pair = (uint32_t)build_nodes.size();
+    build_nodes.push_back( sparse[node.left_first] );
+    build_nodes.push_back( sparse[node.left_first + 1] );
+    build_nodes[new_index].left_first = pair;
+    compact_lbvh( sparse, node.left_first, pair );
+    compact_lbvh( sparse, node.left_first + 1, pair + 1 );
+}
+
+float BVH::restructure_treelets( uint32_t node_index, std::vector<float>& cost, std::vector<uint8_t>& height, int depth,
+                                 ThreadPool* pool ) {
+    BVHNode& node = build_nodes[node_index];
+    if ( node.is_leaf() ) {
+        cost[node_index] = blocks( node.count ) * node.bounds.surface_area();
+        height[node_index] = 0;
+        return cost[node_index];
+    }
+
+    // Here I optimize bottom-up, so every treelet sees final subtrees below
+    uint32_t left = node.left_first;
+    if ( pool && depth < parallel_treelet_depth ) {
+        TaskGroup group( *pool );
+        group.run( [&, left] { restructure_treelets( left, cost, height, depth + 1, pool ); } );
+        restructure_treelets( left + 1, cost, height, depth + 1, pool );
+        group.wait();
+    } else {
+        restructure_treelets( left, cost, height, depth + 1, pool );
+        restructure_treelets( left + 1, cost, height, depth + 1, pool );
+    }
+    cost[node_index] = traversal_cost * node.bounds.surface_area() + cost[left] + cost[left + 1];
+    height[node_index] = (uint8_t)( 1 + std::max( height[left], height[left + 1] ) );
+
+    optimize_treelet( node_index, cost, height, depth );
+    return cost[node_index];
+}
+
+// Karras and Aila's treelet restructuring: grow a treelet below root by
+// repeatedly opening its largest interior leaf, find the topology over the
+// treelet leaves with the lowest SAH cost by dynamic programming over leaf
+// subsets, and rewire the treelet's interior nodes to that topology. The
+// root is at depth; a topology that would make the tree deeper than
+// max_depth is not used.
+void BVH::optimize_treelet( uint32_t root, std::vector<float>& cost, std::vector<uint8_t>& height, int depth ) {
+    uint32_t leaves[treelet_leaves];
+    uint32_t pairs[treelet_leaves - 1];
+    int leaf_count = 2;
+    int pair_count = 1;
+    leaves[0] = build_nodes[root].left_first;
+    leaves[1] = leaves[0] + 1;
+    pairs[0] = leaves[0];
+
+    while ( leaf_count < treelet_leaves ) {
+        int best = -1;
+        float best_area = -1.0f;
+        for ( int i = 0; i < leaf_count; i++ ) {
+            const BVHNode& leaf = build_nodes[leaves[i]];
+            if ( !leaf.is_leaf() && leaf.bounds.surface_area() > best_area ) {
+                best_area = leaf.bounds.surface_area();
+                best = i;
+            }
+        }
+        if ( best < 0 ) {
+            break;
+        }
+        uint32_t children = build_nodes[leaves[best]].left_first;
+        pairs[pair_count++] = children;
+        leaves[best] = children;
+        leaves[leaf_count++] = children + 1;
+    }
+    if ( leaf_count < 3 ) {
+        return;
+    }
+
+    // Here I find the cheapest tree for every subset of the leaves. Subsets of
+    // a set are smaller numbers, so one ascending sweep sees them first.
+    const int subsets = 1 << treelet_leaves;
+    AABB box[subsets];
+    float best_cost[subsets];
+    uint8_t best_left[subsets];
+    uint8_t best_height[subsets];
+    BVHNode leaf_nodes[treelet_leaves];
+    float leaf_cost[treelet_leaves];
+    for ( int i = 0; i < leaf_count; i++ ) {
+        leaf_nodes[i] = build_nodes[leaves[i]];
+        leaf_cost[i] = cost[leaves[i]];
+    }
+
+    uint32_t full = ( 1u << leaf_count ) - 1;
+    for ( uint32_t set = 1; set <= full; set++ ) {
+        uint32_t lowest = set & ( 0u - set );
+        int lowest_leaf = lowest_bit( set );
+        if ( set == lowest ) {
+            box[set] = leaf_nodes[lowest_leaf].bounds;
+            best_cost[set] = leaf_cost[lowest_leaf];
+            best_height[set] = height[leaves[lowest_leaf]];
+            continue;
+        }
+        box[set] = box[set ^ lowest];
+        box[set].expand( leaf_nodes[lowest_leaf].bounds );
+
+        // Splits are counted once by keeping the lowest leaf on the left
+        float best = std::numeric_limits<float>::max();
+        uint8_t best_split = 0;
+        for ( uint32_t left = ( set - 1 ) & set; left; left = ( left - 1 ) & set ) {
+            if ( !( left & lowest ) ) {
+                continue;
+            }
+            float split = best_cost[left] + best_cost[set ^ left];
+            if ( split < best ) {
+                best = split;
+                best_split = (uint8_t)left;
+            }
+        }
+        best_cost[set] = traversal_cost * box[set].surface_area() + best;
+        best_left[set] = best_split;
+        best_height[set] = (uint8_t)( 1 + std::max( best_height[best_split], best_height[set ^ best_split] ) );
+    }
+
+    // The current topology is one of the candidates; only rewire if the
+    // optimum is clearly better and keeps every node above max_depth
+    if ( !( best_cost[full] < cost[root] * 0.9999f ) || depth + best_height[full] >= max_depth ) {
+        return;
+    }
+
+    int next_pair = 0;
+    auto assign = [&]( auto& self, uint32_t set, uint32_t slot ) -> void {
+        if ( popcount( set ) == 1 ) {
+            int leaf = lowest_bit( set );
+            build_nodes[slot] = leaf_nodes[leaf];
+            cost[slot] = leaf_cost[leaf];
+            height[slot] = best_height[set];
+            return;
+        }
+        uint32_t pair = pairs[next_pair++];
+        BVHNode& node = build_nodes[slot];
+        node.bounds = box[set];
+        node.left_first = pair;
+        node.count = 0;
+        cost[slot] = best_cost[set];
+        height[slot] = best_height[set];
+        self( self, best_left[set], pair );
+        self( self, set ^ best_left[set], pair + 1 );
+    };
+    assign( assign, full, root );
+}
+
+float BVH::sah_cost() const {
+    if ( is_wide() ) {
+        // The root has no box of its own, so its area is that of its children
+        AABB root_box;
+        for ( int k = 0; k < wide_nodes[0].child_count; k++ ) {
+            root_box.expand( wide_nodes[0].child_bounds( k ) );
+        }
+        double sum = root_box.surface_area() * traversal_cost;
+        for ( const WideBVHNode& node : wide_nodes ) {
+            for ( int k = 0; k < node.child_count; k++ ) {
+                sum += node.child_bounds( k ).surface_area() * ( node.is_leaf( k ) ? blocks( node.count[k] ) : traversal_cost );
+            }
+        }
+        float root_area = root_box.surface_area();
+        return root_area > 0.0f ? (float)( sum / root_area ) : 0.0f;
+    }
+    if ( nodes.empty() ) {
+        return 0.0f;
+    }
+    double sum = 0.0;
+    for ( const BVHNode& node : nodes ) {
+        sum += node.bounds.surface_area() * ( node.is_leaf() ? blocks( node.count ) : traversal_cost );
+    }
+    float root_area = nodes[0].bounds.surface_area();
+    return root_area > 0.0f ? (float)( sum / root_area ) : 0.0f;
+}
+
+bool BVH::refit( const std::vector<AABB>& prim_bounds ) {
+    if ( prim_bounds.size() != prim_indices.size() ) {
+        return false;
+    }
+    if ( is_wide() ) {
+        WideBVHNode* wide = wide_nodes.edit();
+        AABB box = refit_wide( wide, 0, prim_bounds );
+        return finite_box( box );
+    }
+    if ( nodes.empty() ) {
+        return true;
+    }
+
+    // Children always come after their parent, so one backwards sweep sees
+    // every child before its parent
+    BVHNode* node_data = nodes.edit();
+    for ( size_t i = nodes.size(); i-- > 0; ) {
+        BVHNode& node = node_data[i];
+        node.bounds = AABB();
+        if ( node.is_leaf() ) {
+            for ( uint32_t k = node.left_first; k < node.left_first + node.count; k++ ) {
+                node.bounds.expand( prim_bounds[prim_indices[k]] );
+            }
+        } else {
+            node.bounds.expand( node_data[node.left_first].bounds );
+            node.bounds.expand( node_data[node.left_first + 1].bounds );
+        }
+    }
+    return true;
+}
+
+AABB BVH::refit_wide( WideBVHNode* wide, uint32_t index, const std::vector<AABB>& prim_bounds ) const {
+    // The exact boxes only exist during the refit, the nodes keep their
+    // quantized versions
+    WideBVHNode& node = wide[index];
+    AABB child_boxes[WideBVHNode::width];
+    AABB box;
+    for ( int k = 0; k < node.child_count; k++ ) {
+        if ( node.is_leaf( k ) ) {
+            for ( uint32_t i = node.child[k]; i < node.child[k] + node.count[k]; i++ ) {
+                child_boxes[k].expand( prim_bounds[prim_indices[i]] );
+            }
+        } else {
+            child_boxes[k] = refit_wide( wide, node.child[k], prim_bounds );
+        }
+        box.expand( child_boxes[k] );
+    }
+    if ( finite_box( box ) ) {
+        quantize_children( node, box, child_boxes );
+    }
+    return box;
+}
+
+bool BVH::compress() {
+    if ( nodes.empty() ) {
+        return true;
+    }
+    std::vector<WideBVHNode> wide;
+    wide.reserve( nodes.size() / 3 + 1 );
+    if ( !compress_node( 0, wide ) ) {
+        return false;
+    }
+    wide_nodes.assign( std::move( wide ) );
+    nodes.clear();
+    return true;
+}
+
+bool BVH::compress_node( uint32_t binary_index, std::vector<WideBVHNode>& wide ) const {
+    const BVHNode& parent = nodes[binary_index];
+    const AABB& box = parent.bounds;
+    if ( !finite_box( box ) ) {
+        return false;
+    }
+
+    // Here I open up the interior child with the largest surface area until
+    // the node is full, which pulls the most likely visited nodes up a level
+    uint32_t children[WideBVHNode::width];
+    int child_count = 0;
+    if ( parent.is_leaf() ) {
+        children[child_count++] = binary_index;
+    } else {
+        children[child_count++] = parent.left_first;
+        children[child_count++] = parent.left_first + 1;
+    }
+    while ( child_count < WideBVHNode::width ) {
+        int best = -1;
+        float best_area = -1.0f;
+        for ( int k = 0; k < child_count; k++ ) {
+            const BVHNode& child = nodes[children[k]];
+            if ( !child.is_leaf() && child.bounds.surface_area() > best_area ) {
+                best = k;
+                best_area = child.bounds.surface_area();
+            }
+        }
+        if ( best < 0 ) {
+            break;
+        }
+        uint32_t first = nodes[children[best]].left_first;
+        for ( int k = child_count; k > best + 1; k-- ) {
+            children[k] = children[k - 1];
+        }
+        children[best] = first;
+        children[best + 1] = first + 1;
+        child_count++;
+    }
+
+    WideBVHNode node = {};
+    node.child_count = (uint8_t)child_count;
+    AABB child_boxes[WideBVHNode::width];
+    for ( int k = 0; k < child_count; k++ ) {
+        const BVHNode& child = nodes[children[k]];
+        child_boxes[k] = child.bounds;
+        if ( child.is_leaf() ) {
+            if ( child.count > UINT16_MAX ) {
+                return false;
+            }
+            node.child[k] = child.left_first;
+            node.count[k] = (uint16_t)child.count;
+        }
+    }
+    quantize_children( node, box, child_boxes );
+
+    // Children are numbered after their parent, so the recursion can only
+    // fill in their indices once this node has its place
+    uint32_t index = (uint32_t)wide.size();
+    wide.push_back( node );
+    for ( int k = 0; k < child_count; k++ ) {
+        if ( nodes[children[k]].is_leaf() ) {
+            continue;
+        }
+        uint32_t child_index = (uint32_t)wide.size();
+        if ( !compress_node( children[k], wide ) ) {
+            return false;
+        }
+        wide[index].child[k] = child_index;
+    }
+    return true;
+}
@@ -0,0 +1,775 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "aabb.h"
+#include "ray.h"
+#include "frustum.h"
+#include "data_array.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define WIDE_BVH_SSE2 1
+#endif
+
+// One node of a binary bounding volume hierarchy. Interior nodes keep their two
+// children next to each other, so left_first is the left child and
+// left_first + 1 the right one. Leaves reference count primitives starting at
+// left_first in BVH::prim_indices.
+struct BVHNode {
+    AABB bounds;
+    uint32_t left_first;
+    uint32_t count;
+
+    bool is_leaf() const { return count > 0; }
+};
+
+// Four BVH children in one 64-byte node, a quarter of the size of the binary
+// nodes they replace. Child boxes are stored as 8-bit grid coordinates inside
+// the node's own grid: plane q on an axis lies at origin + q * 2^exponent.
+// Quantization rounds outwards, so the boxes can only grow and traversal
+// finds exactly the hits it finds with the binary nodes.
+struct alignas( 64 ) WideBVHNode {
+    static const int width = 4;
+
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t child_count;
+    uint8_t lo[3][width];
+    uint8_t hi[3][width];
+    // Interior children have count 0 and child is the index of their node.
+    // Leaves reference count primitives starting at child in prim_indices.
+    uint32_t child[width];
+    uint16_t count[width];
+
+    bool is_leaf( int i ) const { return count[i] > 0; }
+
+    // 2^exponent[axis], built directly from the float's exponent bits
+    float scale( int axis ) const {
+        uint32_t bits = (uint32_t)( exponent[axis] + 127 ) << 23;
+        float value;
+        std::memcpy( &value, &bits, sizeof( value ) );
+        return value;
+    }
+
+    AABB child_bounds( int i ) const {
+        float sx = scale( 0 ), sy = scale( 1 ), sz = scale( 2 );
+        return AABB( Vec( origin[0] + lo[0][i] * sx, origin[1] + lo[1][i] * sy, origin[2] + lo[2][i] * sz ),
+                     Vec( origin[0] + hi[0][i] * sx, origin[1] + hi[1][i] * sy, origin[2] + hi[2][i] * sz ) );
+    }
+};
+
+class ThreadPool;
+
+// Which builder lays out a hierarchy. SAH gives the best trees; LBVH sorts
+// primitives along a Morton curve and splits the sorted list, which is much
+// faster for very large inputs, and treelet passes win back most of the
+// trace speed it gives up. The layout picks the node format traversal uses
+// afterwards: the binary nodes as built, or quantized 4-wide nodes.
+struct BVHBuildOptions {
+    enum Builder {
+        SAH,
+        LBVH
+    };
+
+    enum Layout {
+        BINARY,
+        WIDE
+    };
+
+    Builder builder = SAH;
+    int treelet_passes = 0;
+    Layout layout = BINARY;
+
+    static bool parse_builder( const std::string& name, Builder& builder ) {
+        if ( name == "sah" ) {
+            builder = SAH;
+        } else if ( name == "lbvh" ) {
+            builder = LBVH;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static bool parse_layout( const std::string& name, Layout& layout ) {
+        if ( name == "binary" ) {
+            layout = BINARY;
+        } else if ( name == "wide" ) {
+            layout = WIDE;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // All options packed into one number, e.g. to tell cached BVHs apart
+    uint32_t code() const {
+        return (uint32_t)builder | (uint32_t)std::max( 0, std::min( treelet_passes, 255 ) ) << 8 | (uint32_t)layout << 16;
+    }
+
+    const char* builder_name() const {
+        return builder == LBVH ? "lbvh" : "sah";
+    }
+
+    const char* layout_name() const {
+        return layout == WIDE ? "wide" : "binary";
+    }
+};
+
+// Binned surface area heuristic BVH over a list of primitive bounds. It knows
+// nothing about the primitives themselves; traversal hands the primitive
+// range of each leaf to a callback that does the actual intersection.
+class BVH {
+public:
+    static const int max_depth = 64;
+
+    // leaf_block is the number of primitives the leaf callback tests at once
+    // (the SIMD width for triangles). The SAH then counts leaves in blocks
+    // rather than primitives, which favours full blocks.
+    void build( const std::vector<AABB>& prim_bounds, int max_leaf_size = 4, int leaf_block = 1 ) {
+        leaf_size_limit = (uint32_t)std::max( 1, max_leaf_size );
+        block_size = (uint32_t)std::max( 1, leaf_block );
+        build_nodes.clear();
+        build_indices.resize( prim_bounds.size() );
+        for ( size_t i = 0; i < prim_bounds.size(); i++ ) {
+            build_indices[i] = (uint32_t)i;
+        }
+        if ( prim_bounds.empty() ) {
+            nodes.clear();
+            prim_indices.assign( std::move( build_indices ) );
+            return;
+        }
+
+        centroids.resize( prim_bounds.size() );
+        for ( size_t i = 0; i < prim_bounds.size(); i++ ) {
+            centroids[i] = prim_bounds[i].center();
+        }
+
+        build_nodes.reserve( 2 * prim_bounds.size() - 1 );
+        build_nodes.push_back( BVHNode() );
+        build_nodes[0].left_first = 0;
+        build_nodes[0].count = (uint32_t)prim_bounds.size();
+        subdivide( 0, prim_bounds, 1 );
+
+        build_nodes.shrink_to_fit();
+        nodes.assign( std::move( build_nodes ) );
+        prim_indices.assign( std::move( build_indices ) );
+        build_nodes = std::vector<BVHNode>();
+        build_indices = std::vector<uint32_t>();
+        centroids.clear();
+        centroids.shrink_to_fit();
+    }
+
+    // Linear BVH: primitives sorted by the Morton code of their centroid (in
+    // parallel on pool, if given) and split top-down at the highest differing
+    // code bit, followed by treelet_passes rounds of treelet restructuring.
+    // Leaves follow the same size and block rules as build().
+    void build_lbvh( const std::vector<AABB>& prim_bounds, ThreadPool* pool, int max_leaf_size = 4, int leaf_block = 1,
+                     int treelet_passes = 0 );
+
+    // Builds with the builder chosen in options
+    void build( const std::vector<AABB>& prim_bounds, const BVHBuildOptions& options, ThreadPool* pool,
+                int max_leaf_size, int leaf_block ) {
+        if ( options.builder == BVHBuildOptions::LBVH ) {
+            build_lbvh( prim_bounds, pool, max_leaf_size, leaf_block, options.treelet_passes );
+        } else {
+            build( prim_bounds, max_leaf_size, leaf_block );
+        }
+    }
+
+    // Expected cost of a random ray hitting the root: traversal steps plus
+    // leaf blocks tested, weighted by surface area, relative to the root area.
+    // Lower is better; it makes trees from different builders comparable.
+    // Wide nodes are costed with their quantized boxes.
+    float sah_cost() const;
+
+    // Recomputes every box bottom-up for new primitive bounds, indexed as in
+    // the build, and keeps the topology. That is far cheaper than building,
+    // but the tree gets worse the further primitives move from where it was
+    // built for, which sah_cost() shows. Returns false if the bounds don't
+    // fit this tree, or make a wide tree unusable; build again then.
+    bool refit( const std::vector<AABB>& prim_bounds );
+
+    // Uses node and primitive arrays built earlier (e.g. stored in a cache
+    // file) without copying them. The memory must outlive the BVH. Returns
+    // false, leaving the BVH empty, if the arrays don't form a valid tree over
+    // prim_count primitives.
+    bool view( const BVHNode* node_data, size_t node_count, const uint32_t* index_data, size_t prim_count ) {
+        clear();
+        if ( node_count == 0 || node_count >= UINT32_MAX || prim_count >= UINT32_MAX ) {
+            return false;
+        }
+        // Children always come after their parent, which also makes the
+        // depth of every node known by the time it is reached
+        std::vector<uint8_t> depth( node_count, 0 );
+        for ( size_t i = 0; i < node_count; i++ ) {
+            const BVHNode& node = node_data[i];
+            bool valid = node.is_leaf() ? (uint64_t)node.left_first + node.count <= prim_count
+                                        : node.left_first > i && (uint64_t)node.left_first + 1 < node_count;
+            if ( !valid || depth[i] >= max_depth ) {
+                return false;
+            }
+            if ( !node.is_leaf() ) {
+                depth[node.left_first] = depth[node.left_first + 1] = (uint8_t)( depth[i] + 1 );
+            }
+        }
+        nodes.view( node_data, node_count );
+        prim_indices.view( index_data, prim_count );
+        return true;
+    }
+
+    // The same for a hierarchy in the wide layout
+    bool view_wide( const WideBVHNode* node_data, size_t node_count, const uint32_t* index_data, size_t prim_count ) {
+        clear();
+        if ( node_count == 0 || node_count >= UINT32_MAX || prim_count >= UINT32_MAX ) {
+            return false;
+        }
+        std::vector<uint8_t> depth( node_count, 0 );
+        for ( size_t i = 0; i < node_count; i++ ) {
+            const WideBVHNode& node = node_data[i];
+            bool valid = node.child_count >= 1 && node.child_count <= WideBVHNode::width && depth[i] < max_depth;
+            for ( int k = 0; valid && k < node.child_count; k++ ) {
+                uint32_t child = node.child[k];
+                valid = node.is_leaf( k ) ? (uint64_t)child + node.count[k] <= prim_count : child > i && child < node_count;
+                if ( valid && !node.is_leaf( k ) ) {
+                    depth[child] = (uint8_t)( depth[i] + 1 );
+                }
+            }
+            if ( !valid ) {
+                return false;
+            }
+        }
+        wide_nodes.view( node_data, node_count );
+        prim_indices.view( index_data, prim_count );
+        return true;
+    }
+
+    // Converts the binary nodes into the wide layout, see WideBVHNode. The
+    // binary nodes are dropped afterwards. Returns false, keeping the binary
+    // nodes, if a leaf holds more primitives than a wide node can reference.
+    bool compress();
+
+    void clear() {
+        nodes.clear();
+        wide_nodes.clear();
+        prim_indices.clear();
+    }
+
+    bool empty() const {
+        return nodes.empty() && wide_nodes.empty();
+    }
+
+    bool is_wide() const {
+        return !wide_nodes.empty();
+    }
+
+    size_t node_count() const {
+        return is_wide() ? wide_nodes.size() : nodes.size();
+    }
+
+    size_t memory_bytes() const {
+        return nodes.size() * sizeof( BVHNode ) + wide_nodes.size() * sizeof( WideBVHNode ) +
+               prim_indices.size() * sizeof( uint32_t );
+    }
+
+    // Calls fn( uint32_t first, uint32_t count ) for every leaf, in node order
+    template <typename Fn>
+    void for_each_leaf( Fn&& fn ) const {
+        for ( const BVHNode& node : nodes ) {
+            if ( node.is_leaf() ) {
+                fn( node.left_first, node.count );
+            }
+        }
+        for ( const WideBVHNode& node : wide_nodes ) {
+            for ( int k = 0; k < node.child_count; k++ ) {
+                if ( node.is_leaf( k ) ) {
+                    fn( node.child[k], (uint32_t)node.count[k] );
+                }
+            }
+        }
+    }
+
+    // Closest-hit traversal. Children are visited nearest first and any node
+    // whose entry distance lies beyond t_max is skipped, so the callback should
+    // lower t_max whenever it records a closer hit. The callback receives whole
+    // leaves as void( uint32_t first, uint32_t count, float& t_max ), where
+    // first indexes prim_indices.
+    template <typename LeafFn>
+    void intersect( const Ray& ray, float t_max, LeafFn&& leaf ) const {
+        if ( is_wide() ) {
+            intersect_wide( ray, t_max, leaf );
+            return;
+        }
+        if ( nodes.empty() ) {
+            return;
+        }
+
+        Vec inv_dir( 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z );
+        float t_entry;
+        if ( !nodes[0].bounds.intersect( ray.origin, inv_dir, ray.min_t, t_max, t_entry ) ) {
+            return;
+        }
+
+        struct StackEntry {
+            uint32_t node;
+            float t_entry;
+        };
+        StackEntry stack[max_depth * 2];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, t_entry };
+
+        while ( stack_size > 0 ) {
+            StackEntry entry = stack[--stack_size];
+            if ( entry.t_entry > t_max ) {
+                continue;
+            }
+
+            const BVHNode& node = nodes[entry.node];
+            if ( node.is_leaf() ) {
+                leaf( node.left_first, node.count, t_max );
+                continue;
+            }
+
+            uint32_t near_child = node.left_first;
+            uint32_t far_child = node.left_first + 1;
+            float t_near, t_far;
+            bool hit_near = nodes[near_child].bounds.intersect( ray.origin, inv_dir, ray.min_t, t_max, t_near );
+            bool hit_far = nodes[far_child].bounds.intersect( ray.origin, inv_dir, ray.min_t, t_max, t_far );
+
+            if ( hit_near && hit_far ) {
+                if ( t_far < t_near ) {
+                    std::swap( near_child, far_child );
+                    std::swap( t_near, t_far );
+                }
+                // Push the far child first so the near one is popped next
+                stack[stack_size++] = { far_child, t_far };
+                stack[stack_size++] = { near_child, t_near };
+            } else if ( hit_near ) {
+                stack[stack_size++] = { near_child, t_near };
+            } else if ( hit_far ) {
+                stack[stack_size++] = { far_child, t_far };
+            }
+        }
+    }
+
+    // Any-hit traversal for shadow rays. Stops as soon as the callback, called
+    // as bool( uint32_t first, uint32_t count ) for each leaf the ray reaches,
+    // reports an occluder.
+    template <typename LeafFn>
+    bool occluded( const Ray& ray, LeafFn&& leaf ) const {
+        if ( is_wide() ) {
+            return occluded_wide( ray, leaf );
+        }
+        if ( nodes.empty() ) {
+            return false;
+        }
+
+        Vec inv_dir( 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z );
+        uint32_t stack[max_depth * 2];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while ( stack_size > 0 ) {
+            const BVHNode& node = nodes[stack[--stack_size]];
+            float t_entry;
+            if ( !node.bounds.intersect( ray.origin, inv_dir, ray.min_t, ray.max_t, t_entry ) ) {
+                continue;
+            }
+
+            if ( node.is_leaf() ) {
+                if ( leaf( node.left_first, node.count ) ) {
+                    return true;
+                }
+                continue;
+            }
+
+            stack[stack_size++] = node.left_first + 1;
+            stack[stack_size++] = node.left_first;
+        }
+        return false;
+    }
+
+    // Traversal for a bundle of rays that share one origin. Nodes outside the
+    // frustum, or further from its apex than max_distance, are skipped for the
+    // whole bundle at once. The callback receives every remaining leaf as
+    // void( const BVHNode& leaf, float& max_distance ) and should lower
+    // max_distance to the furthest distance any ray in the bundle can still
+    // accept a hit at. In the wide layout leaf.bounds is the quantized box.
+    template <typename LeafFn>
+    void traverse_frustum( const Frustum& frustum, float max_distance, LeafFn&& leaf ) const {
+        if ( is_wide() ) {
+            traverse_frustum_wide( frustum, max_distance, leaf );
+            return;
+        }
+        if ( nodes.empty() || frustum.outside( nodes[0].bounds ) ) {
+            return;
+        }
+
+        struct StackEntry {
+            uint32_t node;
+            float distance;
+        };
+        StackEntry stack[max_depth * 2];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, frustum.distance_to( nodes[0].bounds ) };
+
+        while ( stack_size > 0 ) {
+            StackEntry entry = stack[--stack_size];
+            if ( entry.distance > max_distance ) {
+                continue;
+            }
+
+            const BVHNode& node = nodes[entry.node];
+            if ( node.is_leaf() ) {
+                leaf( node, max_distance );
+                continue;
+            }
+
+            uint32_t near_child = node.left_first;
+            uint32_t far_child = node.left_first + 1;
+            bool hit_near = !frustum.outside( nodes[near_child].bounds );
+            bool hit_far = !frustum.outside( nodes[far_child].bounds );
+            float d_near = hit_near ? frustum.distance_to( nodes[near_child].bounds ) : 0.0f;
+            float d_far = hit_far ? frustum.distance_to( nodes[far_child].bounds ) : 0.0f;
+
+            if ( hit_near && hit_far ) {
+                if ( d_far < d_near ) {
+                    std::swap( near_child, far_child );
+                    std::swap( d_near, d_far );
+                }
+                stack[stack_size++] = { far_child, d_far };
+                stack[stack_size++] = { near_child, d_near };
+            } else if ( hit_near ) {
+                stack[stack_size++] = { near_child, d_near };
+            } else if ( hit_far ) {
+                stack[stack_size++] = { far_child, d_far };
+            }
+        }
+    }
+
+    // Binary nodes, or wide nodes after compress(); the other one is empty
+    DataArray<BVHNode> nodes;
+    DataArray<WideBVHNode> wide_nodes;
+    DataArray<uint32_t> prim_indices;
+
+private:
+    // Wide layout traversal. The callbacks are the same as above. The root
+    // node has no box of its own; its children are tested like any others.
+    template <typename LeafFn>
+    void intersect_wide( const Ray& ray, float t_max, LeafFn& leaf ) const {
+        Vec inv_dir( 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z );
+
+        // count is 0 for interior nodes, as in WideBVHNode
+        struct StackEntry {
+            uint32_t index;
+            uint32_t count;
+            float t_entry;
+        };
+        StackEntry stack[max_depth * WideBVHNode::width];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, 0, ray.min_t };
+
+        while ( stack_size > 0 ) {
+            StackEntry entry = stack[--stack_size];
+            if ( entry.t_entry > t_max ) {
+                continue;
+            }
+            if ( entry.count > 0 ) {
+                leaf( entry.index, entry.count, t_max );
+                continue;
+            }
+
+            const WideBVHNode& node = wide_nodes[entry.index];
+            float t_child[WideBVHNode::width];
+            int hit_mask = intersect_children( node, ray.origin, inv_dir, ray.min_t, t_max, t_child );
+
+            // Here I push the hit children furthest first, so the nearest one
+            // is popped next. Insertion into the top of the stack keeps equal
+            // distances in child order.
+            int base = stack_size;
+            for ( int k = 0; hit_mask; k++, hit_mask >>= 1 ) {
+                if ( !( hit_mask & 1 ) ) {
+                    continue;
+                }
+                StackEntry child = { node.child[k], node.count[k], t_child[k] };
+                int pos = stack_size++;
+                while ( pos > base && stack[pos - 1].t_entry <= child.t_entry ) {
+                    stack[pos] = stack[pos - 1];
+                    pos--;
+                }
+                stack[pos] = child;
+            }
+        }
+    }
+
+    template <typename LeafFn>
+    bool occluded_wide( const Ray& ray, LeafFn& leaf ) const {
+        Vec inv_dir( 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z );
+        uint32_t stack[max_depth * WideBVHNode::width];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while ( stack_size > 0 ) {
+            const WideBVHNode& node = wide_nodes[stack[--stack_size]];
+            float t_child[WideBVHNode::width];
+            int hit_mask = intersect_children( node, ray.origin, inv_dir, ray.min_t, ray.max_t, t_child );
+            for ( int k = 0; hit_mask; k++, hit_mask >>= 1 ) {
+                if ( !( hit_mask & 1 ) ) {
+                    continue;
+                }
+                if ( !node.is_leaf( k ) ) {
+                    stack[stack_size++] = node.child[k];
+                } else if ( leaf( node.child[k], (uint32_t)node.count[k] ) ) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    template <typename LeafFn>
+    void traverse_frustum_wide( const Frustum& frustum, float max_distance, LeafFn& leaf ) const {
+        // Leaves carry their box along for the callback
+        struct StackEntry {
+            BVHNode node;
+            float distance;
+        };
+        StackEntry stack[max_depth * WideBVHNode::width];
+        int stack_size = 0;
+        stack[stack_size].node.left_first = 0;
+        stack[stack_size].node.count = 0;
+        stack[stack_size++].distance = 0.0f;
+
+        while ( stack_size > 0 ) {
+            StackEntry entry = stack[--stack_size];
+            if ( entry.distance > max_distance ) {
+                continue;
+            }
+            if ( entry.node.is_leaf() ) {
+                leaf( entry.node, max_distance );
+                continue;
+            }
+
+            const WideBVHNode& node = wide_nodes[entry.node.left_first];
+            int base = stack_size;
+            for ( int k = 0; k < node.child_count; k++ ) {
+                AABB bounds = node.child_bounds( k );
+                if ( frustum.outside( bounds ) ) {
+                    continue;
+                }
+                StackEntry child;
+                child.node.bounds = bounds;
+                child.node.left_first = node.child[k];
+                child.node.count = node.count[k];
+                child.distance = frustum.distance_to( bounds );
+                int pos = stack_size++;
+                while ( pos > base && stack[pos - 1].distance <= child.distance ) {
+                    stack[pos] = stack[pos - 1];
+                    pos--;
+                }
+                stack[pos] = child;
+            }
+        }
+    }
+
+    // Slab test of all children of a wide node. Returns a bit mask of the
+    // children hit within [t_min, t_max] and their entry distances.
+    // The comparisons mirror AABB::intersect, NaN handling included.
+    static int intersect_children( const WideBVHNode& node, const Vec& origin, const Vec& inv_dir, float t_min, float t_max,
+                                   float t_entry[WideBVHNode::width] ) {
+#if defined(WIDE_BVH_SSE2)
+        __m128 lo_t = _mm_set1_ps( t_min );
+        __m128 hi_t = _mm_set1_ps( t_max );
+        const float origins[3] = { origin.x, origin.y, origin.z };
+        const float inv_dirs[3] = { inv_dir.x, inv_dir.y, inv_dir.z };
+        for ( int axis = 0; axis < 3; axis++ ) {
+            __m128 base = _mm_set1_ps( node.origin[axis] );
+            __m128 step = _mm_set1_ps( node.scale( axis ) );
+            __m128 ray_origin = _mm_set1_ps( origins[axis] );
+            __m128 inv = _mm_set1_ps( inv_dirs[axis] );
+            __m128 t0 = _mm_mul_ps( _mm_sub_ps( _mm_add_ps( base, _mm_mul_ps( unpack_bytes( node.lo[axis] ), step ) ), ray_origin ), inv );
+            __m128 t1 = _mm_mul_ps( _mm_sub_ps( _mm_add_ps( base, _mm_mul_ps( unpack_bytes( node.hi[axis] ), step ) ), ray_origin ), inv );
+            __m128 swap = _mm_cmpgt_ps( t0, t1 );
+            __m128 t_near = _mm_or_ps( _mm_and_ps( swap, t1 ), _mm_andnot_ps( swap, t0 ) );
+            __m128 t_far = _mm_or_ps( _mm_and_ps( swap, t0 ), _mm_andnot_ps( swap, t1 ) );
+            lo_t = _mm_max_ps( t_near, lo_t );
+            hi_t = _mm_min_ps( t_far, hi_t );
+        }
+        _mm_storeu_ps( t_entry, lo_t );
+        return _mm_movemask_ps( _mm_cmple_ps( lo_t, hi_t ) ) & ( ( 1 << node.child_count ) - 1 );
+#else
+        int mask = 0;
+        for ( int k = 0; k < node.child_count; k++ ) {
+            if ( node.child_bounds( k ).intersect( origin, inv_dir, t_min, t_max, t_entry[k] ) ) {
+                mask |= 1 << k;
+            }
+        }
+        return mask;
+#endif
+    }
+
+#if defined(WIDE_BVH_SSE2)
+    // Four 8-bit grid coordinates as floats
+    static __m128 unpack_bytes( const uint8_t q[WideBVHNode::width] ) {
+        int32_t packed;
+        std::memcpy( &packed, q, sizeof( packed ) );
+        __m128i zero = _mm_setzero_si128();
+        __m128i words = _mm_unpacklo_epi8( _mm_cvtsi32_si128( packed ), zero );
+        return _mm_cvtepi32_ps( _mm_unpacklo_epi16( words, zero ) );
+    }
+#endif
+
+    static const int bin_count = 12;
+
+    struct Bin {
+        AABB bounds;
+        uint32_t count = 0;
+    };
+
+    void subdivide( uint32_t node_index, const std::vector<AABB>& prim_bounds, int depth ) {
+        BVHNode& node = build_nodes[node_index];
+        uint32_t first = node.left_first;
+        uint32_t count = node.count;
+
+        AABB centroid_bounds;
+        node.bounds = AABB();
+        for ( uint32_t i = 0; i < count; i++ ) {
+            uint32_t prim = build_indices[first + i];
+            node.bounds.expand( prim_bounds[prim] );
+            centroid_bounds.expand( centroids[prim] );
+        }
+
+        if ( count == 1 || depth >= max_depth ) {
+            return;
+        }
+
+        // Here I look for the cheapest binned split over all three axes
+        int best_axis = -1;
+        int best_split = 0;
+        float best_cost = std::numeric_limits<float>::max();
+
+        for ( int axis = 0; axis < 3; axis++ ) {
+            float axis_lo = centroid_bounds.axis_min( axis );
+            float axis_hi = centroid_bounds.axis_max( axis );
+            if ( axis_hi <= axis_lo ) {
+                continue;
+            }
+
+            Bin bins[bin_count];
+            float scale = bin_count / ( axis_hi - axis_lo );
+            for ( uint32_t i = 0; i < count; i++ ) {
+                uint32_t prim = build_indices[first + i];
+                int b = bin_index( centroids[prim], axis, axis_lo, scale );
+                bins[b].count++;
+                bins[b].bounds.expand( prim_bounds[prim] );
+            }
+
+            // Sweep from both sides to get the cost of every split plane
+            float left_area[bin_count - 1];
+            uint32_t left_count[bin_count - 1];
+            AABB left_box;
+            uint32_t left_sum = 0;
+            for ( int i = 0; i < bin_count - 1; i++ ) {
+                left_sum += bins[i].count;
+                left_box.expand( bins[i].bounds );
+                left_count[i] = left_sum;
+                left_area[i] = left_box.surface_area();
+            }
+
+            AABB right_box;
+            uint32_t right_sum = 0;
+            for ( int i = bin_count - 1; i > 0; i-- ) {
+                right_sum += bins[i].count;
+                right_box.expand( bins[i].bounds );
+                if ( left_count[i - 1] == 0 || right_sum == 0 ) {
+                    continue;
+                }
+                float cost = blocks( left_count[i - 1] ) * left_area[i - 1] + blocks( right_sum ) * right_box.surface_area();
+                if ( cost < best_cost ) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = i;
+                }
+            }
+        }
+
+        float parent_area = node.bounds.surface_area();
+        float leaf_cost = blocks( count );
+        float split_cost = traversal_cost + ( parent_area > 0.0f ? best_cost / parent_area : leaf_cost );
+
+        uint32_t mid;
+        if ( best_axis >= 0 ) {
+            if ( split_cost >= leaf_cost && count <= leaf_size_limit ) {
+                return;
+            }
+
+            float axis_lo = centroid_bounds.axis_min( best_axis );
+            float scale = bin_count / ( centroid_bounds.axis_max( best_axis ) - axis_lo );
+            uint32_t* begin = build_indices.data() + first;
+            uint32_t* split = std::partition( begin, begin + count, [&]( uint32_t prim ) {
+                return bin_index( centroids[prim], best_axis, axis_lo, scale ) < best_split;
+            } );
+            mid = (uint32_t)( split - build_indices.data() );
+        } else {
+            // All centroids coincide, so no plane separates them. Small groups
+            // stay together; large ones are halved to keep leaves bounded.
+            if ( count <= leaf_size_limit ) {
+                return;
+            }
+            mid = first + count / 2;
+        }
+
+        uint32_t left_index = (uint32_t)build_nodes.size();
+        build_nodes.push_back( BVHNode() );
+        build_nodes.push_back( BVHNode() );
+        build_nodes[left_index].left_first = first;
+        build_nodes[left_index].count = mid - first;
+        build_nodes[left_index + 1].left_first = mid;
+        build_nodes[left_index + 1].count = first + count - mid;
+
+        // push_back may have moved the array, so index it again
+        build_nodes[node_index].left_first = left_index;
+        build_nodes[node_index].count = 0;
+
+        subdivide( left_index, prim_bounds, depth + 1 );
+        subdivide( left_index + 1, prim_bounds, depth + 1 );
+    }
+
+    // LBVH helpers, see bvh.cpp
+    AABB emit_lbvh( const std::vector<AABB>& prim_bounds, const std::vector<uint64_t>& codes, uint32_t slot,
+                    uint32_t region, uint32_t first, uint32_t count, int depth, ThreadPool* pool );
+    void compact_lbvh( const std::vector<BVHNode>& sparse, uint32_t old_index, uint32_t new_index );
+    float restructure_treelets( uint32_t node_index, std::vector<float>& cost, std::vector<uint8_t>& height, int depth,
+                                ThreadPool* pool );
+    void optimize_treelet( uint32_t root, std::vector<float>& cost, std::vector<uint8_t>& height, int depth );
+    bool compress_node( uint32_t binary_index, std::vector<WideBVHNode>& wide ) const;
+    AABB refit_wide( WideBVHNode* wide, uint32_t index, const std::vector<AABB>& prim_bounds ) const;
+
+    static int bin_index( const Vec& c, int axis, float axis_lo, float scale ) {
+        float value = axis == 0 ? c.x : ( axis == 1 ? c.y : c.z );
+        int b = (int)( ( value - axis_lo ) * scale );
+        return std::max( 0, std::min( bin_count - 1, b ) );
+    }
+
+    float blocks( uint32_t count ) const {
+        return (float)( ( count + block_size - 1 ) / block_size );
+    }
+
+    static constexpr float traversal_cost = 1.0f;
+
+    uint32_t leaf_size_limit = 4;
+    uint32_t block_size = 1;
+
+    // Work arrays of build(), moved into nodes and prim_indices at the end
+    std::vector<BVHNode> build_nodes;
+    std::vector<uint32_t> build_indices;
+    std::vector<Vec> centroids;
+};
+
+#endif
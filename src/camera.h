@@ -49,6 +49,14 @@ public:
         return Ray( position, world_ray_dir );
     }
 
+    // Angle between the rays through neighbouring pixel centres (roughly,
+    // it is exact at the image centre)
+    float pixel_spread() const {
+        float fov_radians = fov * M_PI / 180.0f;
+        float scale = 2.5f * std::tan(fov_radians / 2.0f);
+        return 2.0f * scale / height;
+    }
+
     Vec position;
     Vec look_at;
     Vec up;
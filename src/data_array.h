@@ -0,0 +1,113 @@
+#ifndef DATA_ARRAY_H
+#define DATA_ARRAY_H
+
+#include <cstddef>
+#include <vector>
+
+// Array that either owns its elements or refers to memory owned by someone
+// else, e.g. a memory-mapped cache file. Either way it is read through one
+// pointer, so lookups cost the same as in a std::vector. Elements can only be
+// changed through edit().
+template <typename T>
+class DataArray {
+public:
+    DataArray() : ptr( nullptr ), count( 0 ) { }
+
+    DataArray( const DataArray& other ) {
+        *this = other;
+    }
+
+    DataArray& operator=( const DataArray& other ) {
+        if ( this != &other ) {
+            if ( other.owns_data() ) {
+                assign( std::vector<T>( other.owned ) );
+            } else {
+                view( other.ptr, other.count );
+            }
+        }
+        return *this;
+    }
+
+    // Moving a vector keeps its buffer, so ptr stays valid
+    DataArray( DataArray&& other ) noexcept : owned( std::move( other.owned ) ), ptr( other.ptr ), count( other.count ) {
+        other.ptr = nullptr;
+        other.count = 0;
+    }
+
+    DataArray& operator=( DataArray&& other ) noexcept {
+        owned = std::move( other.owned );
+        ptr = other.ptr;
+        count = other.count;
+        other.ptr = nullptr;
+        other.count = 0;
+        return *this;
+    }
+
+    // Takes over the elements of values
+    void assign( std::vector<T>&& values ) {
+        owned = std::move( values );
+        ptr = owned.data();
+        count = owned.size();
+    }
+
+    // Refers to size elements at data, which must outlive this array
+    void view( const T* data, size_t size ) {
+        owned = std::vector<T>();
+        ptr = data;
+        count = size;
+    }
+
+    void clear() {
+        owned = std::vector<T>();
+        ptr = nullptr;
+        count = 0;
+    }
+
+    // Writable access to the elements. An array that refers to outside
+    // memory takes a copy first, so the memory it viewed stays untouched.
+    T* edit() {
+        if ( !owns_data() ) {
+            assign( std::vector<T>( ptr, ptr + count ) );
+        }
+        return owned.data();
+    }
+
+    bool owns_data() const {
+        return ptr == owned.data();
+    }
+
+    const T& operator[]( size_t i ) const {
+        return ptr[i];
+    }
+
+    const T* data() const {
+        return ptr;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    const T* begin() const {
+        return ptr;
+    }
+
+    const T* end() const {
+        return ptr + count;
+    }
+
+    const T& back() const {
+        return ptr[count - 1];
+    }
+
+private:
+    std::vector<T> owned;
+    const T* ptr;
+    size_t count;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include "vec.h"
+#include "aabb.h"
+
+// Four planes through a common apex bounding a bundle of rays, e.g. all primary
+// rays through one image tile of a pinhole camera. Plane normals point inwards.
+struct Frustum {
+    Vec apex;
+    Vec normals[4];
+
+    Frustum() { }
+
+    // corners are the directions of the four edge rays in winding order,
+    // center any direction strictly inside the bundle
+    Frustum( const Vec& apex, const Vec corners[4], const Vec& center ) : apex( apex ) {
+        for ( int i = 0; i < 4; i++ ) {
+            Vec n = Vec::cross( corners[i], corners[( i + 1 ) % 4] );
+            if ( Vec::dot( n, center ) < 0 ) {
+                n = -n;
+            }
+            normals[i] = n;
+        }
+    }
+
+    // True if the box lies completely on the outer side of one of the planes.
+    // Only the box corner furthest along each normal has to be checked.
+    bool outside( const AABB& box ) const {
+        for ( int i = 0; i < 4; i++ ) {
+            const Vec& n = normals[i];
+            Vec p( n.x >= 0 ? box.max.x : box.min.x,
+                   n.y >= 0 ? box.max.y : box.min.y,
+                   n.z >= 0 ? box.max.z : box.min.z );
+            if ( Vec::dot( n, p - apex ) < 0 ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Distance from the apex to the nearest point of the box
+    float distance_to( const AABB& box ) const {
+        float dx = std::max( std::max( box.min.x - apex.x, apex.x - box.max.x ), 0.0f );
+        float dy = std::max( std::max( box.min.y - apex.y, apex.y - box.max.y ), 0.0f );
+        float dz = std::max( std::max( box.min.z - apex.z, apex.z - box.max.z ), 0.0f );
+        return std::sqrt( dx * dx + dy * dy + dz * dz );
+    }
+};
+
+#endif
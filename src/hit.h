@@ -11,8 +11,14 @@ struct Hit {
     Vec normal;
     Material* material;
     float u, v;
+    // Texture coordinate area per unit of surface area around the hit, for
+    // choosing a mip level (0 if unknown)
+    float uv_density;
+    // 1 / radius of curvature of the surface, 0 where it is flat
+    float curvature;
 
-    Hit() : t( std::numeric_limits<float>::max() ), normal(), point(), material( nullptr ), u( 0 ), v( 0 ) { }
+    Hit() : t( std::numeric_limits<float>::max() ), normal(), point(), material( nullptr ), u( 0 ), v( 0 ),
+            uv_density( 0 ), curvature( 0 ) { }
 };
 
 #endif 
\ No newline at end of file
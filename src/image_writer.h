@@ -0,0 +1,141 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "vec.h"
+#include "third_party/stb_image_write.h"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes rendered images as PNG on a thread of its own, so encoding one
+// frame overlaps with rendering the next. At most one image waits besides
+// the one being written; write() blocks until there is room, which bounds
+// memory when encoding is slower than rendering.
+class ImageWriter {
+public:
+    ImageWriter() : stopping( false ), busy( false ) {
+        worker = std::thread( [this] { run(); } );
+    }
+
+    ImageWriter( const ImageWriter& ) = delete;
+    ImageWriter& operator=( const ImageWriter& ) = delete;
+
+    ~ImageWriter() {
+        finish();
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+
+    // Queues pixels (linear colour, top row first) to be written to path
+    void write( std::vector<Vec>&& pixels, int width, int height, const std::string& path ) {
+        std::unique_lock<std::mutex> lock( mutex );
+        changed.wait( lock, [this] { return pending.empty(); } );
+        pending.push_back( { std::move( pixels ), width, height, path } );
+        changed.notify_all();
+    }
+
+    // Waits until every queued image is on disk
+    void finish() {
+        std::unique_lock<std::mutex> lock( mutex );
+        changed.wait( lock, [this] { return pending.empty() && !busy; } );
+    }
+
+    // Tone maps and writes one image on the calling thread
+    static bool write_png( const std::vector<Vec>& pixels, int width, int height, const std::string& path ) {
+        std::vector<unsigned char> data = to_rgb8( pixels );
+
+        // Create output directory if it doesn't exist
+        std::filesystem::path file_path( path );
+        std::filesystem::create_directories( file_path.parent_path() );
+
+        return stbi_write_png( path.c_str(), width, height, 3, data.data(), width * 3 ) != 0;
+    }
+
+    // Tone maps and encodes one image into png, the bytes of a PNG file
+    static bool encode_png( const std::vector<Vec>& pixels, int width, int height, std::vector<unsigned char>& png ) {
+        std::vector<unsigned char> data = to_rgb8( pixels );
+        png.clear();
+        auto append = []( void* context, void* bytes, int size ) {
+            std::vector<unsigned char>* out = (std::vector<unsigned char>*)context;
+            out->insert( out->end(), (unsigned char*)bytes, (unsigned char*)bytes + size );
+        };
+        return stbi_write_png_to_func( append, &png, width, height, 3, data.data(), width * 3 ) != 0;
+    }
+
+    // Clamped, gamma corrected 8-bit RGB
+    static std::vector<unsigned char> to_rgb8( const std::vector<Vec>& pixels ) {
+        std::vector<unsigned char> data( pixels.size() * 3 );
+        for ( size_t i = 0; i < pixels.size(); i++ ) {
+            // Clamp values
+            float r = std::max( 0.0f, std::min( 1.0f, pixels[i].x ) );
+            float g = std::max( 0.0f, std::min( 1.0f, pixels[i].y ) );
+            float b = std::max( 0.0f, std::min( 1.0f, pixels[i].z ) );
+
+            // Here I prepare colors for display
+            r = std::pow( r, 1.0f / 2.2f );
+            g = std::pow( g, 1.0f / 2.2f );
+            b = std::pow( b, 1.0f / 2.2f );
+
+            data[i * 3] = (unsigned char)( r * 255 );
+            data[i * 3 + 1] = (unsigned char)( g * 255 );
+            data[i * 3 + 2] = (unsigned char)( b * 255 );
+        }
+        return data;
+    }
+
+private:
+    struct Job {
+        std::vector<Vec> pixels;
+        int width;
+        int height;
+        std::string path;
+    };
+
+    void run() {
+        while ( true ) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock( mutex );
+                changed.wait( lock, [this] { return stopping || !pending.empty(); } );
+                if ( pending.empty() ) {
+                    return;
+                }
+                job = std::move( pending.back() );
+                pending.clear();
+                busy = true;
+            }
+            // The slot is free again, so the next frame can be queued while
+            // this one is encoded
+            changed.notify_all();
+
+            if ( !write_png( job.pixels, job.width, job.height, job.path ) ) {
+                std::cerr << "Error: Failed to write image " << job.path << std::endl;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                busy = false;
+            }
+            changed.notify_all();
+        }
+    }
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<Job> pending;
+    bool stopping;
+    bool busy;
+};
+
+#endif
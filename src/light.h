@@ -2,7 +2,9 @@
 #define LIGHT_H
 
 #include "vec.h"
+#include <algorithm>
 #include <cmath>
+#include <vector>
 
 #define M_PI 3.14159265358979323846
 
@@ -15,6 +17,10 @@ public:
     virtual float get_distance( const Vec& point ) const = 0;
     virtual Vec get_intensity( const Vec& point ) const = 0;
 
+    const Vec& get_color() const {
+        return color;
+    }
+
 protected:
     Vec color;
 };
@@ -54,6 +60,10 @@ public:
         return color / ( 1.0f + 0.09f * dist + 0.032f * dist * dist );
     }
 
+    const Vec& get_position() const {
+        return position;
+    }
+
 private:
     Vec position;
 };
@@ -109,6 +119,22 @@ public:
         return Vec( 0, 0, 0 );
     }
 
+    const Vec& get_position() const {
+        return position;
+    }
+
+    const Vec& get_axis() const {
+        return direction;
+    }
+
+    float get_inner_angle() const {
+        return angle1;
+    }
+
+    float get_outer_angle() const {
+        return angle2;
+    }
+
 private:
     Vec position;
     Vec direction;
@@ -116,4 +142,99 @@ private:
     float angle2;
 };
 
+// The scene's lights compiled into one flat array per light type, so shading
+// can run a plain loop per type instead of virtual calls and casts per light.
+// Ambient lights are folded into a single color. Spot lights keep the cosines
+// of their cone angles: only points in the penumbra band need the acos.
+// Types are shaded in the order point, parallel, spot, the order the scene
+// parser creates them in.
+struct LightSet {
+    Vec ambient;
+
+    struct PointLights {
+        std::vector<float> x, y, z;
+        std::vector<float> r, g, b;
+    } point;
+
+    struct ParallelLights {
+        // Direction towards the light
+        std::vector<float> dx, dy, dz;
+        std::vector<float> r, g, b;
+    } parallel;
+
+    struct SpotLights {
+        std::vector<float> x, y, z;
+        std::vector<float> ax, ay, az;
+        // Fully lit above cos_full, dark below cos_cut, exact test in between
+        std::vector<float> cos_full, cos_cut;
+        std::vector<float> angle1, angle2;
+        std::vector<float> r, g, b;
+    } spot;
+
+    void compile( const std::vector<Light*>& lights ) {
+        *this = LightSet();
+        for ( const Light* light : lights ) {
+            const Vec& c = light->get_color();
+            if ( dynamic_cast<const AmbientLight*>( light ) ) {
+                ambient = ambient + c;
+            } else if ( const PointLight* p = dynamic_cast<const PointLight*>( light ) ) {
+                push( point.x, point.y, point.z, p->get_position() );
+                push( point.r, point.g, point.b, c );
+            } else if ( const ParallelLight* d = dynamic_cast<const ParallelLight*>( light ) ) {
+                push( parallel.dx, parallel.dy, parallel.dz, d->get_direction( Vec() ) );
+                push( parallel.r, parallel.g, parallel.b, c );
+            } else if ( const SpotLight* s = dynamic_cast<const SpotLight*>( light ) ) {
+                push( spot.x, spot.y, spot.z, s->get_position() );
+                push( spot.ax, spot.ay, spot.az, s->get_axis() );
+                push( spot.r, spot.g, spot.b, c );
+                float a1 = s->get_inner_angle();
+                float a2 = s->get_outer_angle();
+                float outer = std::max( a1, a2 );
+                // The margin keeps the fast paths away from the thresholds,
+                // where acos rounding decides. Angles outside [0, 180) always
+                // take the exact path.
+                const float margin = 1e-5f;
+                spot.cos_full.push_back( a1 >= 0.0f && a1 < 180.0f ? std::cos( a1 * (float)M_PI / 180.0f ) + margin : 2.0f );
+                spot.cos_cut.push_back( outer >= 0.0f && outer < 180.0f ? std::cos( outer * (float)M_PI / 180.0f ) - margin : -2.0f );
+                spot.angle1.push_back( a1 );
+                spot.angle2.push_back( a2 );
+            }
+        }
+    }
+
+    size_t size() const {
+        return point.x.size() + parallel.dx.size() + spot.x.size();
+    }
+
+    // Intensity of spot light i at a point at distance dist, with dir pointing
+    // from the point to the light. Same result as SpotLight::get_intensity.
+    Vec spot_intensity( size_t i, const Vec& dir, float dist ) const {
+        float cos_angle = Vec::dot( -dir, Vec( spot.ax[i], spot.ay[i], spot.az[i] ) );
+        if ( cos_angle < spot.cos_cut[i] ) {
+            return Vec( 0, 0, 0 );
+        }
+        Vec color( spot.r[i], spot.g[i], spot.b[i] );
+        float attenuation = 1.0f + 0.09f * dist + 0.032f * dist * dist;
+        if ( cos_angle > spot.cos_full[i] ) {
+            return color / attenuation;
+        }
+
+        float angle = std::acos( cos_angle ) * 180.0f / M_PI;
+        if ( angle <= spot.angle1[i] ) {
+            return color / attenuation;
+        } else if ( angle <= spot.angle2[i] ) {
+            float t = ( angle - spot.angle1[i] ) / ( spot.angle2[i] - spot.angle1[i] );
+            return color * ( 1.0f - t ) / attenuation;
+        }
+        return Vec( 0, 0, 0 );
+    }
+
+private:
+    static void push( std::vector<float>& x, std::vector<float>& y, std::vector<float>& z, const Vec& v ) {
+        x.push_back( v.x );
+        y.push_back( v.y );
+        z.push_back( v.z );
+    }
+};
+
 #endif 
\ No newline at end of file
@@ -1,27 +1,316 @@
 #include <iostream>
+#include <chrono>
 #include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
 #include "scene.h"
+#include "render_server.h"
+#include "thread_pool.h"
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
-int main( int argc, char* argv[] ) {
-    std::cout << "[DEBUG] main() started" << std::endl;
-    if ( argc != 3 ) {
-        std::cerr << "Usage: " << argv[0] << " <input.xml> <output.png>" << std::endl;
-        return 1;
+static void print_usage( const char* program ) {
+    std::cerr << "Usage: " << program << " [options] <input.xml> <output.png>" << std::endl;
+    std::cerr << "       " << program << " [options] --batch <manifest>" << std::endl;
+    std::cerr << "       " << program << " [options] --serve | --serve-socket <path>" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --threads N           render on N threads (default: all cores)" << std::endl;
+    std::cerr << "  --ray-cutoff W        skip reflection/refraction rays contributing less than W (default: 0.001, 0 = off)" << std::endl;
+    std::cerr << "  --russian-roulette    randomly continue rays below the cutoff instead of dropping them" << std::endl;
+    std::cerr << "  --spp N               samples every pixel gets (default: 4, with --time-budget 1)" << std::endl;
+    std::cerr << "  --max-spp N           samples a noisy pixel can get (default: the --spp value)" << std::endl;
+    std::cerr << "  --spp-threshold T     keep sampling pixels whose error is above T (default: 0.01)" << std::endl;
+    std::cerr << "  --sampler S           sample pattern, stratified, sobol or bluenoise (default: stratified, with --time-budget sobol)" << std::endl;
+    std::cerr << "  --seed N              render with the random numbers of seed N (default: 0)" << std::endl;
+    std::cerr << "  --time-budget S       take S seconds per image, refining the noisiest tiles after a first pass" << std::endl;
+    std::cerr << "  --no-mesh-cache       always parse OBJ files, don't read or write .rtmesh files" << std::endl;
+    std::cerr << "  --bvh sah|lbvh        mesh BVH builder (default: from the scene, else sah)" << std::endl;
+    std::cerr << "  --treelets N          treelet restructuring passes after an lbvh build" << std::endl;
+    std::cerr << "  --bvh-format F        BVH node format, binary or wide (quantized 4-wide nodes)" << std::endl;
+    std::cerr << "  --texture-budget MB   keep at most MB of decoded textures between renders (default: no limit)" << std::endl;
+    std::cerr << "  --batch FILE          render every \"input.xml output.png\" line of FILE, sharing meshes and textures" << std::endl;
+    std::cerr << "  --serve               keep scenes loaded and answer render requests on stdin/stdout" << std::endl;
+    std::cerr << "  --serve-socket PATH   the same on a Unix domain socket at PATH" << std::endl;
+    std::cerr << "  --frames A-B          render animation frames A to B to <output>_NNNN.png (default: all frames)" << std::endl;
+}
+
+// Command line options that apply to every scene
+struct RenderSettings {
+    float ray_cutoff = 0.001f;
+    bool russian_roulette = false;
+    int min_samples = 0;
+    int max_samples = 0;
+    float sample_threshold = 0.01f;
+    Sampler sampler;
+    bool sampler_given = false;
+    double time_budget = 0.0;
+    bool mesh_file_cache = true;
+    BVHBuildOptions bvh_options;
+    bool bvh_builder_given = false;
+    bool bvh_layout_given = false;
+    bool bvh_treelets_given = false;
+    int first_frame = -1;
+    int last_frame = -1;
+};
+
+// Applies the settings to a scene that is about to be loaded
+static void configure_scene( Scene& scene, const RenderSettings& settings ) {
+    scene.min_ray_weight = settings.ray_cutoff;
+    scene.russian_roulette = settings.russian_roulette;
+    // A time budget starts with a quick pass
+    scene.min_samples = settings.min_samples > 0 ? settings.min_samples : settings.time_budget > 0.0 ? 1 : 4;
+    scene.max_samples = std::max( settings.max_samples, scene.min_samples );
+    scene.sample_threshold = settings.sample_threshold;
+    scene.sampler = settings.sampler;
+    if ( settings.time_budget > 0.0 && !settings.sampler_given ) {
+        // Its refinement passes keep adding samples, which a Sobol sequence
+        // spreads best
+        scene.sampler.type = Sampler::SOBOL;
+    }
+    scene.time_budget = settings.time_budget;
+    // Only the BVH options given on the command line override the scene file
+    if ( settings.bvh_builder_given ) {
+        scene.bvh_options.builder = settings.bvh_options.builder;
+        scene.bvh_builder_fixed = true;
+    }
+    if ( settings.bvh_layout_given ) {
+        scene.bvh_options.layout = settings.bvh_options.layout;
+        scene.bvh_layout_fixed = true;
     }
+    if ( settings.bvh_treelets_given ) {
+        scene.bvh_options.treelet_passes = settings.bvh_options.treelet_passes;
+        scene.bvh_treelets_fixed = true;
+    }
+}
 
+// Loads one scene, or returns nullptr. Meshes and textures go through the
+// given caches if there are any, else through the scene's own.
+static Scene* load_scene( const std::string& input, const RenderSettings& settings, ThreadPool& pool,
+                          MeshCache* meshes, TextureCache* textures ) {
+    Scene* scene = new Scene();
+    configure_scene( *scene, settings );
+    if ( meshes && textures ) {
+        scene->share_assets( *meshes, *textures );
+    }
+    scene->mesh_cache->use_file_cache = settings.mesh_file_cache;
+    if ( !scene->load( input, pool ) ) {
+        std::cerr << "Failed to load scene file: " << input << std::endl;
+        delete scene;
+        return nullptr;
+    }
+    return scene;
+}
+
+// Renders a loaded scene to output
+static void render_scene( Scene& scene, const std::string& output, const RenderSettings& settings, ThreadPool& pool ) {
     // Create output directory if it doesn't exist
-    std::filesystem::path output_path( argv[2] );
+    std::filesystem::path output_path( output );
     if ( output_path.parent_path().empty() ) {
         output_path = std::filesystem::path( "output" ) / output_path;
     }
     std::filesystem::create_directories( output_path.parent_path() );
 
-    Scene scene;
-    if ( !scene.load( argv[1] ) ) {
-        std::cerr << "Failed to load scene file: " << argv[1] << std::endl;
+    // A scene with an animation, or a frame range, renders a sequence
+    int first_frame = settings.first_frame;
+    int last_frame = settings.last_frame;
+    if ( first_frame >= 0 || scene.animation.frame_count > 0 ) {
+        if ( first_frame < 0 ) {
+            first_frame = 0;
+            last_frame = scene.animation.frame_count - 1;
+        }
+        scene.render_animation( output_path.string(), first_frame, last_frame, pool );
+    } else {
+        scene.render( output_path.string(), pool );
+    }
+}
+
+// Renders every "input.xml output.png" line of a manifest. All scenes share
+// one mesh and one texture cache, so each asset is read once. The scenes are
+// loaded one after the other, each with all its assets loading concurrently,
+// and then rendered concurrently on the pool: the tiles of all scenes in
+// flight compete for the same workers. Loading inside the render tasks
+// instead could leave a thread that waits for its tasks picking up a scene
+// that needs an asset the same thread is still loading further up its stack.
+static bool render_batch( const std::string& manifest_path, const RenderSettings& settings, ThreadPool& pool ) {
+    std::ifstream manifest( manifest_path );
+    if ( !manifest.is_open() ) {
+        std::cerr << "Failed to open batch manifest: " << manifest_path << std::endl;
+        return false;
+    }
+    std::vector<std::pair<std::string, std::string>> jobs;
+    std::string line;
+    int line_number = 0;
+    while ( std::getline( manifest, line ) ) {
+        line_number++;
+        std::istringstream fields( line );
+        std::string input, output, extra;
+        if ( !( fields >> input ) || input[0] == '#' ) {
+            continue;
+        }
+        if ( !( fields >> output ) || ( fields >> extra ) ) {
+            std::cerr << manifest_path << ":" << line_number << ": expected \"input.xml output.png\"" << std::endl;
+            return false;
+        }
+        jobs.push_back( { input, output } );
+    }
+
+    MeshCache meshes;
+    meshes.pool = &pool;
+    meshes.use_file_cache = settings.mesh_file_cache;
+    TextureCache& textures = TextureCache::global();
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Scene*> scenes( jobs.size() );
+    int failed = 0;
+    for ( size_t i = 0; i < jobs.size(); i++ ) {
+        scenes[i] = load_scene( jobs[i].first, settings, pool, &meshes, &textures );
+        if ( !scenes[i] ) {
+            failed++;
+        }
+    }
+    pool.parallel_for( (int)jobs.size(), [&]( int i ) {
+        if ( scenes[i] ) {
+            render_scene( *scenes[i], jobs[i].second, settings, pool );
+        }
+    } );
+    for ( Scene* scene : scenes ) {
+        delete scene;
+    }
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    std::cout << "Batch complete: " << jobs.size() - failed << " of " << jobs.size() << " scenes in " << seconds << " s ("
+              << meshes.size() << " meshes, " << textures.size() << " textures loaded)" << std::endl;
+    return failed == 0;
+}
+
+// Runs the render server until a client sends quit (or, on stdin, until the
+// input ends)
+static bool serve( const std::string& socket_path, const RenderSettings& settings, ThreadPool& pool ) {
+    RenderServer server( pool );
+    server.meshes.use_file_cache = settings.mesh_file_cache;
+    server.configure_scene = [&settings]( Scene& scene ) { configure_scene( scene, settings ); };
+    if ( !socket_path.empty() ) {
+        return server.serve_socket( socket_path );
+    }
+#ifdef _WIN32
+    _setmode( _fileno( stdin ), _O_BINARY );
+    _setmode( _fileno( stdout ), _O_BINARY );
+#endif
+    server.serve( stdin, stdout );
+    return true;
+}
+
+int main( int argc, char* argv[] ) {
+    // Serving on stdin/stdout, stdout carries the replies only, so the log
+    // goes to stderr
+    for ( int i = 1; i < argc; i++ ) {
+        if ( std::string( argv[i] ) == "--serve" ) {
+            std::cout.rdbuf( std::cerr.rdbuf() );
+        }
+    }
+    std::cout << "[DEBUG] main() started" << std::endl;
+
+    int threads = 0;
+    RenderSettings settings;
+    std::string batch_manifest;
+    bool serving = false;
+    std::string socket_path;
+    std::vector<std::string> positional;
+    for ( int i = 1; i < argc; i++ ) {
+        std::string arg = argv[i];
+        if ( arg == "--threads" && i + 1 < argc ) {
+            threads = std::atoi( argv[++i] );
+        } else if ( arg == "--ray-cutoff" && i + 1 < argc ) {
+            settings.ray_cutoff = std::max( 0.0f, (float)std::atof( argv[++i] ) );
+        } else if ( arg == "--russian-roulette" ) {
+            settings.russian_roulette = true;
+        } else if ( arg == "--spp" && i + 1 < argc ) {
+            settings.min_samples = std::max( 1, std::atoi( argv[++i] ) );
+        } else if ( arg == "--max-spp" && i + 1 < argc ) {
+            settings.max_samples = std::max( 1, std::atoi( argv[++i] ) );
+        } else if ( arg == "--spp-threshold" && i + 1 < argc ) {
+            settings.sample_threshold = std::max( 0.0f, (float)std::atof( argv[++i] ) );
+        } else if ( arg == "--sampler" && i + 1 < argc ) {
+            if ( !Sampler::parse_type( argv[++i], settings.sampler.type ) ) {
+                std::cerr << "Unknown sampler: " << argv[i] << std::endl;
+                print_usage( argv[0] );
+                return 1;
+            }
+            settings.sampler_given = true;
+        } else if ( arg == "--time-budget" && i + 1 < argc ) {
+            settings.time_budget = std::max( 0.0, std::atof( argv[++i] ) );
+        } else if ( arg == "--seed" && i + 1 < argc ) {
+            settings.sampler.seed = (uint32_t)std::strtoul( argv[++i], nullptr, 10 );
+        } else if ( arg == "--no-mesh-cache" ) {
+            settings.mesh_file_cache = false;
+        } else if ( arg == "--bvh" && i + 1 < argc ) {
+            if ( !BVHBuildOptions::parse_builder( argv[++i], settings.bvh_options.builder ) ) {
+                std::cerr << "Unknown BVH builder: " << argv[i] << std::endl;
+                print_usage( argv[0] );
+                return 1;
+            }
+            settings.bvh_builder_given = true;
+        } else if ( arg == "--bvh-format" && i + 1 < argc ) {
+            if ( !BVHBuildOptions::parse_layout( argv[++i], settings.bvh_options.layout ) ) {
+                std::cerr << "Unknown BVH format: " << argv[i] << std::endl;
+                print_usage( argv[0] );
+                return 1;
+            }
+            settings.bvh_layout_given = true;
+        } else if ( arg == "--frames" && i + 1 < argc ) {
+            std::string range = argv[++i];
+            size_t dash = range.find( '-', 1 );
+            settings.first_frame = std::atoi( range.c_str() );
+            settings.last_frame = dash == std::string::npos ? settings.first_frame : std::atoi( range.c_str() + dash + 1 );
+            if ( settings.first_frame < 0 || settings.last_frame < settings.first_frame ) {
+                std::cerr << "Invalid frame range: " << range << std::endl;
+                print_usage( argv[0] );
+                return 1;
+            }
+        } else if ( arg == "--batch" && i + 1 < argc ) {
+            batch_manifest = argv[++i];
+        } else if ( arg == "--texture-budget" && i + 1 < argc ) {
+            double megabytes = std::max( 0.0, std::atof( argv[++i] ) );
+            TextureCache::global().set_budget( (size_t)( megabytes * 1024 * 1024 ) );
+        } else if ( arg == "--serve" ) {
+            serving = true;
+        } else if ( arg == "--serve-socket" && i + 1 < argc ) {
+            serving = true;
+            socket_path = argv[++i];
+        } else if ( arg == "--treelets" && i + 1 < argc ) {
+            settings.bvh_options.treelet_passes = std::max( 0, std::atoi( argv[++i] ) );
+            settings.bvh_treelets_given = true;
+        } else if ( arg.rfind( "--", 0 ) == 0 ) {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            print_usage( argv[0] );
+            return 1;
+        } else {
+            positional.push_back( arg );
+        }
+    }
+
+    size_t expected = serving || !batch_manifest.empty() ? 0 : 2;
+    if ( positional.size() != expected || ( serving && !batch_manifest.empty() ) ) {
+        print_usage( argv[0] );
         return 1;
     }
-    scene.render( output_path.string() );
 
+    ThreadPool pool( threads );
+    if ( serving ) {
+        return serve( socket_path, settings, pool ) ? 0 : 1;
+    }
+    if ( !batch_manifest.empty() ) {
+        return render_batch( batch_manifest, settings, pool ) ? 0 : 1;
+    }
+    Scene* scene = load_scene( positional[0], settings, pool, nullptr, nullptr );
+    if ( !scene ) {
+        return 1;
+    }
+    render_scene( *scene, positional[1], settings, pool );
+    delete scene;
     return 0;
 }
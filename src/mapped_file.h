@@ -0,0 +1,100 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+#define MAPPED_FILE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. On POSIX systems the file is memory-mapped,
+// so only the pages that are actually touched get read; elsewhere it is read
+// into memory in one go.
+class MappedFile {
+public:
+    MappedFile() : bytes( nullptr ), length( 0 ), mapped( false ) { }
+    MappedFile( const MappedFile& ) = delete;
+    MappedFile& operator=( const MappedFile& ) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open( const std::string& path ) {
+        close();
+#ifdef MAPPED_FILE_MMAP
+        int fd = ::open( path.c_str(), O_RDONLY );
+        if ( fd < 0 ) {
+            return false;
+        }
+        struct stat info;
+        if ( fstat( fd, &info ) != 0 ) {
+            ::close( fd );
+            return false;
+        }
+        length = (size_t)info.st_size;
+        if ( length > 0 ) {
+            void* address = mmap( nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if ( address == MAP_FAILED ) {
+                ::close( fd );
+                length = 0;
+                return false;
+            }
+            bytes = (const char*)address;
+            mapped = true;
+        }
+        // The mapping stays valid after the descriptor is closed
+        ::close( fd );
+        return true;
+#else
+        std::ifstream file( path, std::ios::binary | std::ios::ate );
+        if ( !file.is_open() ) {
+            return false;
+        }
+        buffer.resize( (size_t)file.tellg() );
+        file.seekg( 0 );
+        if ( !buffer.empty() && !file.read( buffer.data(), (std::streamsize)buffer.size() ) ) {
+            buffer.clear();
+            return false;
+        }
+        bytes = buffer.data();
+        length = buffer.size();
+        return true;
+#endif
+    }
+
+    void close() {
+#ifdef MAPPED_FILE_MMAP
+        if ( mapped ) {
+            munmap( (void*)bytes, length );
+        }
+#endif
+        buffer.clear();
+        bytes = nullptr;
+        length = 0;
+        mapped = false;
+    }
+
+    const char* data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+private:
+    const char* bytes;
+    size_t length;
+    bool mapped;
+    std::vector<char> buffer;
+};
+
+#endif
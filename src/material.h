@@ -8,12 +8,13 @@
 #include <vector>
 #include <iostream>
 #include <cstring>
-#include "third_party/stb_image.h"
+#include "texture.h"
 
 class Material {
 public:
     Material() : 
         color(1, 1, 1),
+        linear_color(1, 1, 1),
         ka(0.1f),
         kd(0.7f),
         ks(0.2f),
@@ -22,13 +23,12 @@ public:
         transmission(0.0f),
         ior(1.0f),
         is_textured(false),
-        texture_data(nullptr),
-        texture_width(0),
-        texture_height(0),
-        texture_channels(0) {}
+        texture(nullptr),
+        owned_texture(nullptr) {}
 
     Material( const Vec& color, float ka, float kd, float ks, float shininess, float reflection, float transmission, float ior ) :
         color( color ),
+        linear_color( srgb_to_linear( color ) ),
         ka( ka ),
         kd( kd ),
         ks( ks ),
@@ -37,18 +37,16 @@ public:
         transmission( transmission ),
         ior( ior ),
         is_textured(false),
-        texture_data(nullptr),
-        texture_width(0),
-        texture_height(0),
-        texture_channels(0) {}
+        texture(nullptr),
+        owned_texture(nullptr) {}
 
     virtual ~Material() {
-        if (texture_data) {
-            delete[] texture_data;
-        }
+        delete owned_texture;
     }
 
     Vec color;
+    // color converted from sRGB once, for shading
+    Vec linear_color;
     float ka;  // Ambient coefficient
     float kd;  // Diffuse coefficient
     float ks;  // Specular coefficient
@@ -57,95 +55,30 @@ public:
     float transmission;
     float ior;  // Index of refraction
 
-    virtual Vec get_color ( float u, float v ) const {
-        if ( is_textured && texture_data ) {
-            // Here I wrap the coordinates for tiling
-            u = u - floorf(u);
-            v = v - floorf(v);
-            
-            // Here I convert to texture pixel locations
-            int x = (int)(u * (texture_width - 1));
-            int y = (int)(v * (texture_height - 1));
-            
-            // Get pixel from texture
-            int index = (y * texture_width + x) * texture_channels;
-            if (index >= 0 && index < texture_width * texture_height * texture_channels) {
-                float r = texture_data[index] / 255.0f;
-                float g = texture_data[index + 1] / 255.0f;
-                float b = texture_data[index + 2] / 255.0f;
-                
-                // Here I convert the color values
-                auto srgb_to_linear = [](float srgb) {
-                    if (srgb <= 0.04045f) {
-                        return srgb / 12.92f;
-                    } else {
-                        return std::pow((srgb + 0.055f) / 1.055f, 2.4f);
-                    }
-                };
-                
-                r = srgb_to_linear(r);
-                g = srgb_to_linear(g);
-                b = srgb_to_linear(b);
-                
-                // Here I return the processed colors
-                return Vec(r, g, b);
-            }
+    // footprint is the width of the area the lookup stands for, in texture
+    // coordinates; 0 samples the finest texture level
+    virtual Vec get_color ( float u, float v, float footprint = 0.0f ) const {
+        Vec texel;
+        if ( is_textured && texture && texture->sample( u, v, footprint, texel ) ) {
+            return texel;
         }
-        
         // Here I handle the fallback colors
-        auto srgb_to_linear = [](float srgb) {
-            if (srgb <= 0.04045f) {
-                return srgb / 12.92f;
-            } else {
-                return std::pow((srgb + 0.055f) / 1.055f, 2.4f);
-            }
-        };
-        
-        float r = srgb_to_linear(color.x);
-        float g = srgb_to_linear(color.y);
-        float b = srgb_to_linear(color.z);
-        
-        return Vec(r, g, b);
+        return linear_color;
     }
 
-    bool load_texture(const std::string& filename) {
-        std::cout << "Loading texture: " << filename << std::endl;
-        
-        // Clean up previous texture data
-        if (texture_data) {
-            delete[] texture_data;
-            texture_data = nullptr;
-        }
-        
-        // Try to load the actual image file
-        std::string full_path = "scenes/" + filename;
-        
-        // Use STB to load the image
-        int width, height, channels;
-        unsigned char* loaded_data = stbi_load(full_path.c_str(), &width, &height, &channels, 3);
-        
-        if (loaded_data) {
-            std::cout << "Successfully loaded texture: " << filename << " (" << width << "x" << height << ", " << channels << " channels)" << std::endl;
-            
-            texture_width = width;
-            texture_height = height;
-            texture_channels = 3; // Force RGB
-            
-            // Copy the loaded data
-            int data_size = texture_width * texture_height * texture_channels;
-            texture_data = new unsigned char[data_size];
-            memcpy(texture_data, loaded_data, data_size);
-            
-            // Free the STB loaded data
-            stbi_image_free(loaded_data);
-            
-            is_textured = true;
-            return true;
+    // Takes the texture from cache when given, so materials using the same
+    // file share it; without a cache the material keeps its own copy. The
+    // file is only read once the texture is sampled.
+    void load_texture( const std::string& filename, TextureCache* cache = nullptr ) {
+        delete owned_texture;
+        owned_texture = nullptr;
+        if ( cache ) {
+            texture = cache->get( filename );
         } else {
-            std::cout << "Failed to load texture: " << filename << " - using default color" << std::endl;
-            is_textured = false;
-            return false;
+            owned_texture = new Texture( filename );
+            texture = owned_texture;
         }
+        is_textured = true;
     }
 
 private:
@@ -226,10 +159,8 @@ public:
     std::string texture_name;
 
 protected:
-    unsigned char* texture_data;
-    int texture_width;
-    int texture_height;
-    int texture_channels;
+    const Texture* texture;
+    Texture* owned_texture;
 };
 
 struct TexturedMaterial : public Material {
@@ -240,12 +171,13 @@ struct TexturedMaterial : public Material {
                       float exp = 10.0f,
                       float r = 0.0f,
                       float t = 0.0f,
-                      float ior = 1.0f )
+                      float ior = 1.0f,
+                      TextureCache* cache = nullptr )
         : Material ( Vec ( 1, 1, 1 ), ka, kd, ks, exp, r, t, ior ),
           texture_file ( texture_file ) { 
         is_textured = true;
         texture_name = texture_file;
-        load_texture(texture_file);
+        load_texture( texture_file, cache );
     }
 
     std::string texture_file;
@@ -0,0 +1,490 @@
+#include "mesh.h"
+#include "mapped_file.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Layout of a .rtmesh file: this header, then the arrays listed in
+// RtmeshSection, each starting at a multiple of rtmesh_alignment so they can
+// be used in place once the file is mapped. Data is in native byte order;
+// files written by a different version, build configuration or machine are
+// ignored and rewritten.
+const char rtmesh_magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+const uint32_t rtmesh_version = 3;
+const uint32_t rtmesh_byte_order = 0x01020304;
+const size_t rtmesh_alignment = 64;
+
+enum RtmeshSection {
+    SECTION_INDICES,
+    SECTION_POSITIONS,
+    SECTION_NORMALS,
+    SECTION_UVS,
+    SECTION_TRIANGLE_FLAGS,
+    SECTION_PACKETS,
+    SECTION_PACKET_FIRST,
+    SECTION_BVH_NODES,
+    SECTION_BVH_PRIMS,
+    SECTION_BVH_WIDE_NODES,
+    SECTION_COUNT
+};
+
+const size_t rtmesh_element_size[SECTION_COUNT] = {
+    sizeof( uint32_t ), sizeof( float ), sizeof( float ), sizeof( float ), sizeof( uint8_t ),
+    sizeof( TrianglePacket ), sizeof( uint32_t ), sizeof( BVHNode ), sizeof( uint32_t ),
+    sizeof( WideBVHNode )
+};
+
+struct RtmeshHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    // Layout of the stored structures, which depends on the SIMD width
+    uint32_t packet_width;
+    uint32_t packet_bytes;
+    uint32_t node_bytes;
+    uint32_t wide_node_bytes;
+    // Builder, treelet passes and node layout the BVH was made with
+    uint32_t bvh_build;
+    uint32_t padding;
+    // The OBJ the data was made from. A changed mtime alone (a fresh checkout,
+    // a copy) only costs hashing the OBJ once to confirm the content.
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+    float bounds[6];
+    uint64_t counts[SECTION_COUNT];
+};
+
+size_t rtmesh_align( size_t offset ) {
+    return ( offset + rtmesh_alignment - 1 ) / rtmesh_alignment * rtmesh_alignment;
+}
+
+// 64-bit hash of a file's content, eight bytes at a time on four independent
+// lanes so it runs at memory speed
+uint64_t content_hash( const char* data, size_t size ) {
+    const uint64_t prime = 0x9E3779B97F4A7C15ull;
+    uint64_t lanes[4] = { size, prime, ~(uint64_t)size, 0x2545F4914F6CDD1Dull };
+    size_t i = 0;
+    for ( ; i + 32 <= size; i += 32 ) {
+        for ( int k = 0; k < 4; k++ ) {
+            uint64_t word;
+            std::memcpy( &word, data + i + k * 8, 8 );
+            lanes[k] = ( lanes[k] ^ word ) * prime;
+            lanes[k] ^= lanes[k] >> 32;
+        }
+    }
+    uint64_t h = lanes[0] ^ ( lanes[1] * 3 ) ^ ( lanes[2] * 5 ) ^ ( lanes[3] * 7 );
+    for ( ; i < size; i++ ) {
+        h = ( h ^ (uint8_t)data[i] ) * prime;
+    }
+    return h ^ ( h >> 29 );
+}
+
+bool hash_file( const std::string& path, uint64_t& hash ) {
+    MappedFile file;
+    if ( !file.open( path ) ) {
+        return false;
+    }
+    hash = content_hash( file.data(), file.size() );
+    return true;
+}
+
+// One OBJ face corner. Corners with the same position, texcoord and normal
+// indices become the same vertex.
+struct CornerKey {
+    int v, t, n;
+
+    bool operator==( const CornerKey& other ) const {
+        return v == other.v && t == other.t && n == other.n;
+    }
+};
+
+struct CornerKeyHash {
+    size_t operator()( const CornerKey& key ) const {
+        size_t h = (size_t)(uint32_t)key.v;
+        h = h * 0x9E3779B97F4A7C15ull ^ (uint32_t)key.t;
+        h = h * 0x9E3779B97F4A7C15ull ^ (uint32_t)key.n;
+        return h ^ ( h >> 29 );
+    }
+};
+
+bool valid_corners( const int idx[3], size_t size ) {
+    return idx[0] >= 0 && idx[1] >= 0 && idx[2] >= 0 &&
+           (size_t)idx[0] < size && (size_t)idx[1] < size && (size_t)idx[2] < size;
+}
+
+}
+
+bool MeshGeometry::load( const std::string& filename, ThreadPool* pool, bool use_file_cache, const BVHBuildOptions& bvh_options ) {
+    std::string full_path = "scenes/" + filename;
+    std::string cache_path = full_path + ".rtmesh";
+
+    std::error_code error;
+    uint64_t source_size = std::filesystem::file_size( full_path, error );
+    int64_t source_mtime = error ? 0 : (int64_t)std::filesystem::last_write_time( full_path, error ).time_since_epoch().count();
+    use_file_cache = use_file_cache && !error;
+    uint32_t bvh_build = bvh_options.code();
+    bool cached = use_file_cache && read_cache( cache_path, full_path, source_size, source_mtime, bvh_build );
+
+    if ( !cached ) {
+        ObjMeshData mesh_data;
+        if ( !load_obj_mesh( full_path, mesh_data, pool ) ) {
+            std::cerr << "Error: Failed to load mesh file: " << full_path << std::endl;
+            return false;
+        }
+        if ( !weld( mesh_data ) ) {
+            return false;
+        }
+        build_acceleration( bvh_options, pool );
+
+        uint64_t source_hash;
+        if ( use_file_cache && hash_file( full_path, source_hash ) ) {
+            write_cache( cache_path, source_size, source_mtime, source_hash, bvh_build );
+        }
+    }
+
+    std::cout << "Loaded mesh " << filename << ( cached ? " (cached)" : "" ) << ": " << triangle_count() << " triangles, "
+              << vertex_count() << " vertices, " << packets.size() << " packets, " << memory_bytes() / 1024 << " KB (BVH "
+              << (double)bvh.memory_bytes() / triangle_count() << " bytes/triangle)" << std::endl;
+    return true;
+}
+
+bool MeshGeometry::weld( const ObjMeshData& mesh_data ) {
+    if ( mesh_data.vertices.empty() || mesh_data.faces.empty() ) {
+        return false;
+    }
+
+    bool any_normals = false;
+    bool any_texcoords = false;
+    for ( const auto& f : mesh_data.faces ) {
+        any_normals = any_normals || valid_corners( f.n, mesh_data.normals.size() );
+        any_texcoords = any_texcoords || valid_corners( f.t, mesh_data.texcoords.size() );
+    }
+
+    std::vector<uint32_t> index_data;
+    std::vector<float> position_data;
+    std::vector<float> normal_data;
+    std::vector<float> uv_data;
+    std::vector<uint8_t> flag_data;
+    std::unordered_map<CornerKey, uint32_t, CornerKeyHash> vertex_ids;
+    index_data.reserve( mesh_data.faces.size() * 3 );
+    flag_data.reserve( mesh_data.faces.size() );
+
+    for ( const auto& f : mesh_data.faces ) {
+        if ( !valid_corners( f.v, mesh_data.vertices.size() ) ) {
+            continue;
+        }
+
+        uint8_t flags = 0;
+        if ( valid_corners( f.n, mesh_data.normals.size() ) ) flags |= HAS_NORMALS;
+        if ( valid_corners( f.t, mesh_data.texcoords.size() ) ) flags |= HAS_TEXCOORDS;
+
+        for ( int i = 0; i < 3; i++ ) {
+            // Attributes the triangle doesn't use are left out of the key, so
+            // they don't split otherwise shared vertices
+            CornerKey key = { f.v[i], ( flags & HAS_TEXCOORDS ) ? f.t[i] : -1, ( flags & HAS_NORMALS ) ? f.n[i] : -1 };
+            auto it = vertex_ids.find( key );
+            if ( it == vertex_ids.end() ) {
+                uint32_t id = (uint32_t)( position_data.size() / 3 );
+                const Vec& p = mesh_data.vertices[key.v];
+                position_data.insert( position_data.end(), { p.x, p.y, p.z } );
+                if ( any_normals ) {
+                    Vec n = key.n >= 0 ? mesh_data.normals[key.n] : Vec();
+                    normal_data.insert( normal_data.end(), { n.x, n.y, n.z } );
+                }
+                if ( any_texcoords ) {
+                    Vec t = key.t >= 0 ? mesh_data.texcoords[key.t] : Vec();
+                    uv_data.insert( uv_data.end(), { t.x, t.y } );
+                }
+                it = vertex_ids.emplace( key, id ).first;
+            }
+            index_data.push_back( it->second );
+        }
+        flag_data.push_back( flags );
+    }
+
+    if ( index_data.empty() ) {
+        return false;
+    }
+    indices.assign( std::move( index_data ) );
+    positions.assign( std::move( position_data ) );
+    normals.assign( std::move( normal_data ) );
+    uvs.assign( std::move( uv_data ) );
+    triangle_flags.assign( std::move( flag_data ) );
+    return true;
+}
+
+void MeshGeometry::build_acceleration( const BVHBuildOptions& bvh_options, ThreadPool* pool ) {
+    size_t count = triangle_count();
+    local_bounds = AABB();
+    std::vector<AABB> triangle_bounds( count );
+    for ( size_t i = 0; i < count; i++ ) {
+        for ( int k = 0; k < 3; k++ ) {
+            triangle_bounds[i].expand( position( indices[i * 3 + k] ) );
+        }
+        local_bounds.expand( triangle_bounds[i] );
+    }
+
+    // Here I build the bottom-level BVH over the triangles in object space
+    auto start = std::chrono::steady_clock::now();
+    bvh.build( triangle_bounds, bvh_options, pool, 2 * TrianglePacket::width, TrianglePacket::width );
+    double build_ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    std::cout << "Built " << bvh_options.builder_name() << " BVH";
+    if ( bvh_options.builder == BVHBuildOptions::LBVH && bvh_options.treelet_passes > 0 ) {
+        std::cout << " with " << bvh_options.treelet_passes << " treelet passes";
+    }
+    std::cout << " in " << build_ms << " ms: " << bvh.nodes.size() << " nodes, SAH cost " << bvh.sah_cost() << std::endl;
+
+    // and pack the intersection data leaf by leaf, padding each leaf's last
+    // packet with empty lanes
+    std::vector<TrianglePacket> packet_data;
+    std::vector<uint32_t> first_data( count, 0 );
+    bvh.for_each_leaf( [&]( uint32_t first, uint32_t leaf_count ) {
+        first_data[first] = (uint32_t)packet_data.size();
+        for ( uint32_t i = 0; i < leaf_count; i++ ) {
+            int lane = i % TrianglePacket::width;
+            if ( lane == 0 ) {
+                packet_data.emplace_back();
+                packet_data.back().clear();
+            }
+            uint32_t index = bvh.prim_indices[first + i];
+            const uint32_t* tri = &indices[index * 3];
+            Vec v0 = position( tri[0] );
+            packet_data.back().set( lane, v0, position( tri[1] ) - v0, position( tri[2] ) - v0, index );
+        }
+    } );
+    packets.assign( std::move( packet_data ) );
+    packet_first.assign( std::move( first_data ) );
+
+    if ( bvh_options.layout == BVHBuildOptions::WIDE ) {
+        size_t binary_bytes = bvh.memory_bytes();
+        if ( bvh.compress() ) {
+            std::cout << "Compressed BVH to " << bvh.wide_nodes.size() << " wide nodes: " << binary_bytes / 1024 << " KB -> "
+                      << bvh.memory_bytes() / 1024 << " KB" << std::endl;
+        } else {
+            std::cerr << "Warning: BVH leaves too large for wide nodes, keeping binary nodes" << std::endl;
+        }
+    }
+}
+
+bool MeshGeometry::read_cache( const std::string& path, const std::string& source_path, uint64_t source_size, int64_t source_mtime,
+                               uint32_t bvh_build ) {
+    if ( !cache_file.open( path ) || cache_file.size() < sizeof( RtmeshHeader ) ) {
+        cache_file.close();
+        return false;
+    }
+
+    RtmeshHeader header;
+    std::memcpy( &header, cache_file.data(), sizeof( header ) );
+    bool usable = std::memcmp( header.magic, rtmesh_magic, sizeof( header.magic ) ) == 0 && header.version == rtmesh_version &&
+                  header.byte_order == rtmesh_byte_order && header.packet_width == TrianglePacket::width &&
+                  header.packet_bytes == sizeof( TrianglePacket ) && header.node_bytes == sizeof( BVHNode ) &&
+                  header.wide_node_bytes == sizeof( WideBVHNode ) &&
+                  header.bvh_build == bvh_build && header.source_size == source_size;
+
+    // Here I fall back to comparing content when only the mtime differs,
+    // and refresh the stamp so the next run takes the fast path again
+    if ( usable && header.source_mtime != source_mtime ) {
+        uint64_t source_hash;
+        usable = hash_file( source_path, source_hash ) && source_hash == header.source_hash;
+        if ( usable ) {
+            header.source_mtime = source_mtime;
+            std::fstream file( path, std::ios::binary | std::ios::in | std::ios::out );
+            file.write( (const char*)&header, sizeof( header ) );
+        }
+    }
+
+    // Here I check that the sections fit the file and each other
+    const uint64_t* counts = header.counts;
+    size_t offsets[SECTION_COUNT];
+    size_t offset = rtmesh_align( sizeof( header ) );
+    for ( int i = 0; usable && i < SECTION_COUNT; i++ ) {
+        usable = counts[i] <= cache_file.size();
+        offsets[i] = offset;
+        offset = rtmesh_align( offset + counts[i] * rtmesh_element_size[i] );
+    }
+    uint64_t triangles = counts[SECTION_INDICES] / 3;
+    uint64_t vertices = counts[SECTION_POSITIONS] / 3;
+    usable = usable && offset == cache_file.size() && triangles > 0 && counts[SECTION_INDICES] % 3 == 0 &&
+             counts[SECTION_POSITIONS] % 3 == 0 && vertices > 0 &&
+             ( counts[SECTION_NORMALS] == 0 || counts[SECTION_NORMALS] == vertices * 3 ) &&
+             ( counts[SECTION_UVS] == 0 || counts[SECTION_UVS] == vertices * 2 ) &&
+             counts[SECTION_TRIANGLE_FLAGS] == triangles && counts[SECTION_PACKET_FIRST] == triangles &&
+             counts[SECTION_BVH_PRIMS] == triangles && ( counts[SECTION_BVH_NODES] == 0 ) != ( counts[SECTION_BVH_WIDE_NODES] == 0 );
+    if ( !usable ) {
+        cache_file.close();
+        return false;
+    }
+
+    const char* data = cache_file.data();
+    const uint32_t* first_data = (const uint32_t*)( data + offsets[SECTION_PACKET_FIRST] );
+    const uint32_t* prim_data = (const uint32_t*)( data + offsets[SECTION_BVH_PRIMS] );
+    bool viewed = counts[SECTION_BVH_WIDE_NODES] > 0
+        ? bvh.view_wide( (const WideBVHNode*)( data + offsets[SECTION_BVH_WIDE_NODES] ), counts[SECTION_BVH_WIDE_NODES], prim_data, triangles )
+        : bvh.view( (const BVHNode*)( data + offsets[SECTION_BVH_NODES] ), counts[SECTION_BVH_NODES], prim_data, triangles );
+    if ( !viewed ) {
+        cache_file.close();
+        return false;
+    }
+    bool packets_fit = true;
+    bvh.for_each_leaf( [&]( uint32_t first, uint32_t leaf_count ) {
+        packets_fit = packets_fit &&
+                      (uint64_t)first_data[first] + ( leaf_count + TrianglePacket::width - 1 ) / TrianglePacket::width <= counts[SECTION_PACKETS];
+    } );
+    if ( !packets_fit ) {
+        bvh.clear();
+        cache_file.close();
+        return false;
+    }
+
+    // Here I check every index the intersection code follows, so a damaged
+    // file can't make it read out of bounds. That is one linear pass over
+    // the integer arrays; the vertex data itself needs no check.
+    const uint32_t* index_data = (const uint32_t*)( data + offsets[SECTION_INDICES] );
+    const uint8_t* flag_data = (const uint8_t*)( data + offsets[SECTION_TRIANGLE_FLAGS] );
+    const TrianglePacket* packet_data = (const TrianglePacket*)( data + offsets[SECTION_PACKETS] );
+    bool valid = true;
+    for ( uint64_t i = 0; i < counts[SECTION_INDICES]; i++ ) {
+        valid = valid && index_data[i] < vertices;
+    }
+    for ( uint64_t i = 0; i < triangles; i++ ) {
+        valid = valid && ( !( flag_data[i] & HAS_NORMALS ) || counts[SECTION_NORMALS] > 0 ) &&
+                ( !( flag_data[i] & HAS_TEXCOORDS ) || counts[SECTION_UVS] > 0 ) && bvh.prim_indices[i] < triangles;
+    }
+    for ( uint64_t p = 0; p < counts[SECTION_PACKETS]; p++ ) {
+        for ( int lane = 0; lane < TrianglePacket::width; lane++ ) {
+            valid = valid && ( packet_data[p].prim[lane] < triangles || packet_data[p].prim[lane] == TrianglePacket::no_prim );
+        }
+    }
+    if ( !valid ) {
+        bvh.clear();
+        cache_file.close();
+        return false;
+    }
+
+    // Everything else is used straight from the mapping
+    indices.view( index_data, counts[SECTION_INDICES] );
+    positions.view( (const float*)( data + offsets[SECTION_POSITIONS] ), counts[SECTION_POSITIONS] );
+    normals.view( (const float*)( data + offsets[SECTION_NORMALS] ), counts[SECTION_NORMALS] );
+    uvs.view( (const float*)( data + offsets[SECTION_UVS] ), counts[SECTION_UVS] );
+    triangle_flags.view( flag_data, counts[SECTION_TRIANGLE_FLAGS] );
+    packets.view( packet_data, counts[SECTION_PACKETS] );
+    packet_first.view( first_data, counts[SECTION_PACKET_FIRST] );
+    local_bounds.min = Vec( header.bounds[0], header.bounds[1], header.bounds[2] );
+    local_bounds.max = Vec( header.bounds[3], header.bounds[4], header.bounds[5] );
+    return true;
+}
+
+void MeshGeometry::write_cache( const std::string& path, uint64_t source_size, int64_t source_mtime, uint64_t source_hash,
+                                uint32_t bvh_build ) const {
+    RtmeshHeader header = {};
+    std::memcpy( header.magic, rtmesh_magic, sizeof( header.magic ) );
+    header.version = rtmesh_version;
+    header.byte_order = rtmesh_byte_order;
+    header.packet_width = TrianglePacket::width;
+    header.packet_bytes = sizeof( TrianglePacket );
+    header.node_bytes = sizeof( BVHNode );
+    header.wide_node_bytes = sizeof( WideBVHNode );
+    header.bvh_build = bvh_build;
+    header.source_size = source_size;
+    header.source_mtime = source_mtime;
+    header.source_hash = source_hash;
+    float bounds[6] = { local_bounds.min.x, local_bounds.min.y, local_bounds.min.z,
+                        local_bounds.max.x, local_bounds.max.y, local_bounds.max.z };
+    std::memcpy( header.bounds, bounds, sizeof( bounds ) );
+
+    const void* sections[SECTION_COUNT] = {
+        indices.data(), positions.data(), normals.data(), uvs.data(), triangle_flags.data(),
+        packets.data(), packet_first.data(), bvh.nodes.data(), bvh.prim_indices.data(), bvh.wide_nodes.data()
+    };
+    size_t counts[SECTION_COUNT] = {
+        indices.size(), positions.size(), normals.size(), uvs.size(), triangle_flags.size(),
+        packets.size(), packet_first.size(), bvh.nodes.size(), bvh.prim_indices.size(), bvh.wide_nodes.size()
+    };
+    for ( int i = 0; i < SECTION_COUNT; i++ ) {
+        header.counts[i] = counts[i];
+    }
+
+    // Here I write to a temporary file and rename it, so a concurrent or
+    // interrupted run never sees a half written cache. The temporary name is
+    // unique per process and per write, so two writers of the same cache
+    // never share one. Failing to write the cache is not an error, the next
+    // run just parses the OBJ again.
+    static std::atomic<unsigned> write_count( 0 );
+    std::string temp_path = path + "." + std::to_string( (long)getpid() ) + "." + std::to_string( write_count++ ) + ".tmp";
+    {
+        std::ofstream file( temp_path, std::ios::binary );
+        if ( !file.is_open() ) {
+            return;
+        }
+        const char zeros[rtmesh_alignment] = {};
+        size_t offset = 0;
+        auto write = [&]( const void* data, size_t bytes ) {
+            file.write( (const char*)data, (std::streamsize)bytes );
+            offset += bytes;
+            file.write( zeros, (std::streamsize)( rtmesh_align( offset ) - offset ) );
+            offset = rtmesh_align( offset );
+        };
+        write( &header, sizeof( header ) );
+        for ( int i = 0; i < SECTION_COUNT; i++ ) {
+            write( sections[i], counts[i] * rtmesh_element_size[i] );
+        }
+        if ( !file.good() ) {
+            file.close();
+            std::error_code ignored;
+            std::filesystem::remove( temp_path, ignored );
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename( temp_path, path, error );
+    if ( error ) {
+        std::filesystem::remove( temp_path, error );
+    }
+}
+
+bool MeshGeometry::normal_at( const Vec& local_point, Vec& normal ) const {
+    for ( size_t i = 0; i < triangle_count(); i++ ) {
+        const uint32_t* tri = &indices[i * 3];
+        Vec v0 = position( tri[0] );
+        Vec e1 = position( tri[1] ) - v0;
+        Vec e2 = position( tri[2] ) - v0;
+
+        // Barycentric coordinates of the point
+        Vec p = local_point - v0;
+        float d00 = Vec::dot( e1, e1 );
+        float d01 = Vec::dot( e1, e2 );
+        float d11 = Vec::dot( e2, e2 );
+        float d20 = Vec::dot( p, e1 );
+        float d21 = Vec::dot( p, e2 );
+        float denom = d00 * d11 - d01 * d01;
+        float v = ( d11 * d20 - d01 * d21 ) / denom;
+        float w = ( d00 * d21 - d01 * d20 ) / denom;
+        float u = 1.0f - v - w;
+        if ( u < 0.0f || v < 0.0f || w < 0.0f ) {
+            continue;
+        }
+
+        if ( triangle_flags[i] & HAS_NORMALS ) {
+            Vec n0( normals[tri[0] * 3], normals[tri[0] * 3 + 1], normals[tri[0] * 3 + 2] );
+            Vec n1( normals[tri[1] * 3], normals[tri[1] * 3 + 1], normals[tri[1] * 3 + 2] );
+            Vec n2( normals[tri[2] * 3], normals[tri[2] * 3 + 1], normals[tri[2] * 3 + 2] );
+            normal = ( u * n0 + v * n1 + w * n2 ).normalize();
+        } else {
+            normal = Vec::cross( e1, e2 ).normalize();
+        }
+        return true;
+    }
+    return false;
+}
@@ -2,84 +2,263 @@
 #define MESH_H
 
 #include "object.h"
-#include "triangle.h"
 #include "material.h"
+#include "bvh.h"
+#include "triangle_simd.h"
+#include "data_array.h"
+#include "mapped_file.h"
 #include <vector>
-#include <fstream>
-#include <sstream>
 #include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <cstdint>
 #include "transform.h"
 #include "obj_utils.h"
+#include "thread_pool.h"
 #include <iostream>
 #include <cmath>
 
-class Mesh : public Object {
+// Triangle data and acceleration structure of one OBJ file. It is loaded once
+// and then shared by every Mesh instance that references the same file.
+//
+// Vertices are unique (position, uv, normal) combinations kept in flat arrays
+// and referenced by a single index buffer. The data the intersection loop
+// needs (v0 and both edges) is precomputed per triangle and packed into
+// TrianglePackets in BVH leaf order, so each leaf is a contiguous run of
+// packets that the SIMD kernel tests several triangles at a time.
+class MeshGeometry {
 public:
-    Mesh() : Object() { }
-    Mesh(Material* mat) : Object(mat) { }
-
-    bool load(const std::string& filename) {
-        ObjMeshData mesh_data;
-        std::string full_path = "scenes/" + filename;
-        
-        if ( !load_obj_mesh( full_path, mesh_data ) ) {
-            std::cerr << "Error: Failed to load mesh file: " << full_path << std::endl;
-            return false;
+    enum TriangleFlags : uint8_t {
+        HAS_NORMALS = 1,
+        HAS_TEXCOORDS = 2
+    };
+
+    MeshGeometry() { }
+    MeshGeometry( const MeshGeometry& ) = delete;
+    MeshGeometry& operator=( const MeshGeometry& ) = delete;
+
+    // Loads scenes/<filename>. The welded vertex and index buffers, the BVH
+    // and the triangle packets are kept in a binary "<filename>.rtmesh" file
+    // next to the OBJ. Later loads map that file and use the data in place,
+    // without parsing or building anything, as long as the OBJ is unchanged
+    // and the BVH was made with the same options.
+    bool load( const std::string& filename, ThreadPool* pool = nullptr, bool use_file_cache = true,
+               const BVHBuildOptions& bvh_options = BVHBuildOptions() );
+
+    size_t triangle_count() const {
+        return indices.size() / 3;
+    }
+
+    size_t vertex_count() const {
+        return positions.size() / 3;
+    }
+
+    size_t memory_bytes() const {
+        return indices.size() * sizeof( uint32_t ) +
+               ( positions.size() + normals.size() + uvs.size() ) * sizeof( float ) +
+               triangle_flags.size() * sizeof( uint8_t ) +
+               packets.size() * sizeof( TrianglePacket ) + packet_first.size() * sizeof( uint32_t ) +
+               bvh.memory_bytes();
+    }
+
+    // Closest hit in object space. hit.t is the local ray parameter. Only the
+    // winning triangle gets its point, normal and texture coordinates filled in.
+    bool intersect( const Ray& local_ray, float t_max, Hit& hit ) const {
+        bool found = false;
+        float closest_local_t = INFINITY;
+        uint32_t closest_index = 0;
+        uint32_t closest_packet = 0;
+        int closest_lane = 0;
+        float closest_u = 0.0f;
+        float closest_v = 0.0f;
+        PacketRay packet_ray( local_ray );
+
+        // Nearest nodes come first and every hit lowers the traversal bound,
+        // so most of the mesh is never looked at
+        bvh.intersect( local_ray, t_max, [&]( uint32_t first, uint32_t count, float& node_t_max ) {
+            uint32_t begin = packet_first[first];
+            uint32_t end = begin + ( count + TrianglePacket::width - 1 ) / TrianglePacket::width;
+            for ( uint32_t p = begin; p < end; p++ ) {
+                float t[TrianglePacket::width], u[TrianglePacket::width], v[TrianglePacket::width];
+                int mask = intersect_packet( packets[p], packet_ray, t, u, v );
+                for ( int lane = 0; mask; lane++, mask >>= 1 ) {
+                    if ( !( mask & 1 ) ) {
+                        continue;
+                    }
+                    uint32_t index = packets[p].prim[lane];
+                    if ( t[lane] < closest_local_t || ( t[lane] == closest_local_t && index < closest_index ) ) {
+                        closest_local_t = t[lane];
+                        closest_index = index;
+                        closest_packet = p;
+                        closest_lane = lane;
+                        closest_u = u[lane];
+                        closest_v = v[lane];
+                        found = true;
+                        node_t_max = std::min( node_t_max, closest_local_t );
+                    }
+                }
+            }
+        } );
+
+        if ( found ) {
+            fill_hit( packets[closest_packet], closest_lane, closest_index, local_ray, closest_local_t, closest_u, closest_v, hit );
         }
-        
-        if ( mesh_data.vertices.empty() || mesh_data.faces.empty() ) {
+        return found;
+    }
+
+    // Any triangle hit with local t up to t_max. Stops at the first one and
+    // computes no hit attributes.
+    bool occluded( const Ray& local_ray, float t_max ) const {
+        PacketRay packet_ray( local_ray );
+        Ray bounded_ray( local_ray.origin, local_ray.direction, local_ray.min_t, t_max );
+
+        return bvh.occluded( bounded_ray, [&]( uint32_t first, uint32_t count ) {
+            uint32_t begin = packet_first[first];
+            uint32_t end = begin + ( count + TrianglePacket::width - 1 ) / TrianglePacket::width;
+            for ( uint32_t p = begin; p < end; p++ ) {
+                float t[TrianglePacket::width], u[TrianglePacket::width], v[TrianglePacket::width];
+                int mask = intersect_packet( packets[p], packet_ray, t, u, v );
+                for ( int lane = 0; mask; lane++, mask >>= 1 ) {
+                    if ( ( mask & 1 ) && t[lane] <= t_max ) {
+                        return true;
+                    }
+                }
+            }
             return false;
+        } );
+    }
+
+    // Interpolated vertex normal (or the face normal) at a local point, or
+    // false if the point lies on none of the triangles
+    bool normal_at( const Vec& local_point, Vec& normal ) const;
+
+    DataArray<uint32_t> indices;
+    DataArray<float> positions;
+    DataArray<float> normals;
+    DataArray<float> uvs;
+    DataArray<uint8_t> triangle_flags;
+
+    // Leaf triangles in packets; the leaf starting at BVH slot i starts at
+    // packets[packet_first[i]]
+    DataArray<TrianglePacket> packets;
+    DataArray<uint32_t> packet_first;
+
+    AABB local_bounds;
+    BVH bvh;
+
+private:
+    MappedFile cache_file;
+
+    // Welds the OBJ face corners into indexed vertices
+    bool weld( const ObjMeshData& mesh_data );
+    // A valid cache file stays mapped and the arrays refer into it
+    bool read_cache( const std::string& path, const std::string& source_path, uint64_t source_size, int64_t source_mtime,
+                     uint32_t bvh_build );
+    void write_cache( const std::string& path, uint64_t source_size, int64_t source_mtime, uint64_t source_hash,
+                      uint32_t bvh_build ) const;
+    // Bounds, BVH and triangle packets from the vertex and index buffers
+    void build_acceleration( const BVHBuildOptions& bvh_options, ThreadPool* pool );
+
+    Vec position( uint32_t vertex ) const {
+        return Vec( positions[vertex * 3], positions[vertex * 3 + 1], positions[vertex * 3 + 2] );
+    }
+
+    void fill_hit( const TrianglePacket& packet, int lane, uint32_t index, const Ray& ray, float t, float u, float v, Hit& hit ) const {
+        hit.t = t;
+        hit.point = ray.origin + ray.direction * t;
+
+        Vec cross = Vec::cross( packet.edge1( lane ), packet.edge2( lane ) );
+        Vec n = cross.normalize();
+        if ( Vec::dot( n, ray.direction ) > 0 ) {
+            n = n * -1.0;
         }
-        
-        vertices = mesh_data.vertices;
-        normals = mesh_data.normals;
-        texcoords = mesh_data.texcoords;
-        
-        for ( const auto& f : mesh_data.faces ) {
-            if ( f.v[0] >= 0 && f.v[1] >= 0 && f.v[2] >= 0 && 
-                 f.v[0] < vertices.size() && f.v[1] < vertices.size() && f.v[2] < vertices.size() ) {
-                
-                // Create triangle without material - material will be handled by the mesh
-                Triangle* tri = new Triangle( vertices[f.v[0]], vertices[f.v[1]], vertices[f.v[2]], nullptr );
-                
-                if ( f.n[0] >= 0 && f.n[1] >= 0 && f.n[2] >= 0 && 
-                     f.n[0] < normals.size() && f.n[1] < normals.size() && f.n[2] < normals.size() ) {
-                    tri->set_normals( normals[f.n[0]], normals[f.n[1]], normals[f.n[2]] );
-                }
-                
-                if ( f.t[0] >= 0 && f.t[1] >= 0 && f.t[2] >= 0 && 
-                     f.t[0] < texcoords.size() && f.t[1] < texcoords.size() && f.t[2] < texcoords.size() ) {
-                    tri->set_tex_coords( texcoords[f.t[0]], texcoords[f.t[1]], texcoords[f.t[2]] );
-                }
-                
-                triangles.push_back( tri );
+        hit.normal = n;
+        hit.material = nullptr;
+
+        // Here I set the surface coordinates. Without texture coordinates
+        // the barycentrics span half a unit square.
+        float uv_area = 0.5f;
+        if ( triangle_flags[index] & HAS_TEXCOORDS ) {
+            const uint32_t* tri = &indices[index * 3];
+            float w = 1.0f - u - v;
+            hit.u = w * uvs[tri[0] * 2] + u * uvs[tri[1] * 2] + v * uvs[tri[2] * 2];
+            hit.v = w * uvs[tri[0] * 2 + 1] + u * uvs[tri[1] * 2 + 1] + v * uvs[tri[2] * 2 + 1];
+            float du1 = uvs[tri[1] * 2] - uvs[tri[0] * 2], dv1 = uvs[tri[1] * 2 + 1] - uvs[tri[0] * 2 + 1];
+            float du2 = uvs[tri[2] * 2] - uvs[tri[0] * 2], dv2 = uvs[tri[2] * 2 + 1] - uvs[tri[0] * 2 + 1];
+            uv_area = 0.5f * std::abs( du1 * dv2 - du2 * dv1 );
+        } else {
+            hit.u = u;
+            hit.v = v;
+        }
+        float area = 0.5f * cross.length();
+        hit.uv_density = area > 0.0f ? uv_area / area : 0.0f;
+        hit.curvature = 0.0f;
+    }
+};
+
+// Mesh geometry by file name and BVH options, so every mesh using the same
+// file shares one copy. Safe to use from several threads, like TextureCache:
+// each geometry loads once, and different files load in parallel.
+class MeshCache {
+public:
+    MeshCache() { }
+    MeshCache( const MeshCache& ) = delete;
+    MeshCache& operator=( const MeshCache& ) = delete;
+
+    // Returns nullptr if the file could not be loaded; the failure is cached too
+    const MeshGeometry* get( const std::string& filename, const BVHBuildOptions& bvh_options = BVHBuildOptions() ) {
+        Entry* entry;
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            std::unique_ptr<Entry>& slot = geometries[{ filename, bvh_options.code() }];
+            if ( !slot ) {
+                slot.reset( new Entry() );
             }
+            entry = slot.get();
         }
-        
-        return triangles.size() > 0;
+        std::call_once( entry->once, [&] {
+            if ( entry->geometry.load( filename, pool, use_file_cache, bvh_options ) ) {
+                entry->loaded = true;
+            }
+        } );
+        return entry->loaded ? &entry->geometry : nullptr;
     }
 
+    size_t size() {
+        std::lock_guard<std::mutex> lock( mutex );
+        return geometries.size();
+    }
+
+    // Pool for parsing large OBJ files in parallel (optional)
+    ThreadPool* pool = nullptr;
+    // Read and write .rtmesh files next to the OBJ files
+    bool use_file_cache = true;
+
+private:
+    struct Entry {
+        std::once_flag once;
+        MeshGeometry geometry;
+        bool loaded = false;
+    };
+
+    std::mutex mutex;
+    std::map<std::pair<std::string, uint32_t>, std::unique_ptr<Entry>> geometries;
+};
+
+// One placement of a shared MeshGeometry: only its transform and material are
+// per instance.
+class Mesh : public Object {
+public:
+    Mesh( const MeshGeometry* geometry ) : Object(), geometry( geometry ) { }
+    Mesh( const MeshGeometry* geometry, Material* mat ) : Object( mat ), geometry( geometry ) { }
+
     bool intersect( const Ray& ray, Hit& hit ) const override {
         Ray local_ray = transform.inverse_transform_ray( ray );
 
-        bool found = false;
-        float closest_local_t = INFINITY;
         Hit closest_hit;
-
-        for ( Triangle* tri : triangles ) {
-            Hit temp_hit;
-            temp_hit.t = INFINITY;
-            
-            if ( tri->intersect( local_ray, temp_hit ) ) {
-                if ( temp_hit.t < closest_local_t && temp_hit.t > 0.001f ) {
-                    closest_local_t = temp_hit.t;
-                    closest_hit = temp_hit;
-                    found = true;
-                }
-            }
-        }
-
-        if ( found ) {
+        if ( geometry->intersect( local_ray, ray.max_t, closest_hit ) ) {
             // Transform back to world space
             Vec world_point = transform.transform_point( closest_hit.point );
             Vec world_normal = transform.transform_normal( closest_hit.normal ).normalize();
@@ -98,6 +277,8 @@ public:
                 // Here I pass through the texture coordinates
                 hit.u = closest_hit.u;
                 hit.v = closest_hit.v;
+                hit.uv_density = closest_hit.uv_density / transform.area_scale( closest_hit.normal );
+                hit.curvature = 0.0f;
                 return true;
             }
         }
@@ -105,28 +286,24 @@ public:
         return false;
     }
 
+    bool occluded( const Ray& ray ) const override {
+        return geometry->occluded( transform.inverse_transform_ray( ray ), ray.max_t );
+    }
+
     Vec get_normal(const Vec& point) const override {
         Vec local_point = transform.inverse_transform_point(point);
-        for (Triangle* tri : triangles) {
-            if (tri->contains_point(local_point)) {
-                Vec local_normal = tri->get_normal(local_point);
-                return transform.transform_normal(local_normal);
-            }
+        Vec local_normal;
+        if (geometry->normal_at(local_point, local_normal)) {
+            return transform.transform_normal(local_normal);
         }
         return Vec(0, 1, 0);  // Default normal
     }
 
-    ~Mesh() {
-        for (Triangle* tri : triangles) {
-            delete tri;
-        }
+    AABB get_bounds() const override {
+        return transform.transform_bounds( geometry->local_bounds );
     }
 
-    std::vector<Vec> vertices;
-    std::vector<Vec> normals;
-    std::vector<Vec> texcoords;
-    std::vector<Triangle*> triangles;
-    Transform transform;
+    const MeshGeometry* geometry;
 };
 
-#endif 
\ No newline at end of file
+#endif
@@ -1,66 +1,192 @@
 #include "obj_utils.h"
-#include <fstream>
-#include <sstream>
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
 #include <iostream>
 
-bool load_obj_mesh( const std::string& path, ObjMeshData& out ) {
-    std::ifstream file( path );
-    if ( !file.is_open() ) {
-        std::cerr << "Error: Cannot open OBJ file: " << path << std::endl;
+namespace {
+
+// Chunks smaller than this aren't worth a task of their own
+const size_t min_chunk_bytes = 1 << 20;
+
+bool is_space( char c ) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+const char* skip_space( const char* p, const char* end ) {
+    while ( p < end && is_space( *p ) ) p++;
+    return p;
+}
+
+const char* token_end( const char* p, const char* end ) {
+    while ( p < end && !is_space( *p ) ) p++;
+    return p;
+}
+
+// Next whitespace separated float of the line, or 0 if there is none
+float parse_float( const char*& p, const char* end ) {
+    p = skip_space( p, end );
+    const char* start = p;
+    // Here I accept an explicit plus sign like stream extraction does
+    if ( start < end && *start == '+' ) start++;
+    float value = 0.0f;
+    std::from_chars_result result = std::from_chars( start, token_end( start, end ), value );
+    if ( result.ec != std::errc() ) {
+        return 0.0f;
+    }
+    p = result.ptr;
+    return value;
+}
+
+// Integer at the start of [p, end), ignoring whatever follows it (like
+// std::stoi). False if there are no digits or the value doesn't fit.
+bool parse_int( const char* p, const char* end, int& value ) {
+    if ( p < end && *p == '+' ) p++;
+    return std::from_chars( p, end, value ).ec == std::errc();
+}
+
+// One face corner "v", "v/t", "v//n" or "v/t/n" with 1-based indices. If any
+// index is malformed the whole corner is marked invalid (-1) and false is
+// returned.
+bool parse_corner( const char* p, const char* end, int& v, int& t, int& n ) {
+    v = t = n = -1;
+    const char* slash1 = std::find( p, end, '/' );
+    bool ok = parse_int( p, slash1, v );
+    if ( ok && slash1 < end ) {
+        const char* slash2 = std::find( slash1 + 1, end, '/' );
+        if ( slash2 > slash1 + 1 ) {
+            ok = parse_int( slash1 + 1, slash2, t );
+            t = ok ? t - 1 : -1;
+        }
+        if ( ok && slash2 < end && slash2 + 1 < end ) {
+            ok = parse_int( slash2 + 1, end, n );
+            n = ok ? n - 1 : -1;
+        }
+    }
+    if ( !ok ) {
+        v = t = n = -1;
         return false;
     }
-    
-    std::string line;
-    while ( std::getline( file, line ) ) {
-        std::istringstream iss( line );
-        std::string type;
-        iss >> type;
-        if ( type == "v" ) {
-            float x, y, z;
-            iss >> x >> y >> z;
+    v--;
+    return true;
+}
+
+// Parses the complete lines in [begin, end). Returns false if a face had
+// malformed indices.
+bool parse_chunk( const char* begin, const char* end, ObjMeshData& out ) {
+    bool clean = true;
+    const char* line = begin;
+    while ( line < end ) {
+        const char* line_end = (const char*)std::memchr( line, '\n', end - line );
+        if ( !line_end ) line_end = end;
+
+        const char* p = skip_space( line, line_end );
+        const char* type_end = token_end( p, line_end );
+        size_t type_length = type_end - p;
+
+        if ( type_length == 1 && p[0] == 'v' ) {
+            float x = parse_float( type_end, line_end );
+            float y = parse_float( type_end, line_end );
+            float z = parse_float( type_end, line_end );
             out.vertices.push_back( Vec( x, y, z ) );
-        } else if ( type == "vn" ) {
-            float x, y, z;
-            iss >> x >> y >> z;
+        } else if ( type_length == 2 && p[0] == 'v' && p[1] == 'n' ) {
+            float x = parse_float( type_end, line_end );
+            float y = parse_float( type_end, line_end );
+            float z = parse_float( type_end, line_end );
             out.normals.push_back( Vec( x, y, z ) );
-        } else if ( type == "vt" ) {
-            float u, v;
-            iss >> u >> v;
+        } else if ( type_length == 2 && p[0] == 'v' && p[1] == 't' ) {
+            float u = parse_float( type_end, line_end );
+            float v = parse_float( type_end, line_end );
             out.texcoords.push_back( Vec( u, v, 0 ) );
-        } else if ( type == "f" ) {
+        } else if ( type_length == 1 && p[0] == 'f' ) {
+            // Only the first three corners are used
             ObjMeshData::Face face;
+            const char* corner = type_end;
             for ( int i = 0; i < 3; i++ ) {
-                std::string vert;
-                iss >> vert;
-                int v = -1, t = -1, n = -1;
-                try {
-                    size_t p1 = vert.find( '/' );
-                    if ( p1 == std::string::npos ) {
-                        v = std::stoi( vert ) - 1;
-                    } else {
-                        v = std::stoi( vert.substr( 0, p1 ) ) - 1;
-                        size_t p2 = vert.find( '/', p1 + 1 );
-                        if ( p2 == std::string::npos ) {
-                            std::string t_str = vert.substr( p1 + 1 );
-                            if ( !t_str.empty() ) t = std::stoi( t_str ) - 1;
-                        } else {
-                            std::string t_str = vert.substr( p1 + 1, p2 - p1 - 1 );
-                            if ( !t_str.empty() ) t = std::stoi( t_str ) - 1;
-                            std::string n_str = vert.substr( p2 + 1 );
-                            if ( !n_str.empty() ) n = std::stoi( n_str ) - 1;
-                        }
-                    }
-                } catch ( const std::exception& e ) {
-                    std::cerr << "Error parsing face indices in OBJ file: " << path << std::endl;
-                    continue;
+                corner = skip_space( corner, line_end );
+                const char* corner_end = token_end( corner, line_end );
+                if ( !parse_corner( corner, corner_end, face.v[i], face.t[i], face.n[i] ) ) {
+                    clean = false;
                 }
-                face.v[i] = v;
-                face.t[i] = t;
-                face.n[i] = n;
+                corner = corner_end;
             }
             out.faces.push_back( face );
         }
+
+        line = line_end + 1;
     }
-    
+    return clean;
+}
+
+template <typename T>
+void append( std::vector<T>& to, const std::vector<T>& from ) {
+    to.insert( to.end(), from.begin(), from.end() );
+}
+
+}
+
+bool load_obj_mesh( const std::string& path, ObjMeshData& out, ThreadPool* pool ) {
+    MappedFile file;
+    if ( !file.open( path ) ) {
+        std::cerr << "Error: Cannot open OBJ file: " << path << std::endl;
+        return false;
+    }
+
+    const char* data = file.data();
+    size_t size = file.size();
+
+    // Here I cut the file into chunks at line boundaries. Indices in OBJ
+    // faces are absolute, so the chunks can be parsed independently and
+    // simply concatenated in order.
+    size_t chunk_count = 1;
+    if ( pool && pool->size() > 1 ) {
+        chunk_count = std::max( (size_t)1, std::min( size / min_chunk_bytes, (size_t)pool->size() * 4 ) );
+    }
+    std::vector<size_t> bounds( 1, 0 );
+    for ( size_t i = 1; i < chunk_count; i++ ) {
+        size_t cut = std::max( bounds.back(), size * i / chunk_count );
+        const char* newline = (const char*)std::memchr( data + cut, '\n', size - cut );
+        cut = newline ? newline - data + 1 : size;
+        if ( cut > bounds.back() && cut < size ) {
+            bounds.push_back( cut );
+        }
+    }
+    bounds.push_back( size );
+    chunk_count = bounds.size() - 1;
+
+    std::vector<ObjMeshData> chunks( chunk_count );
+    std::vector<char> clean( chunk_count, 1 );
+    auto parse = [&]( int i ) {
+        clean[i] = parse_chunk( data + bounds[i], data + bounds[i + 1], chunks[i] );
+    };
+    if ( chunk_count > 1 ) {
+        pool->parallel_for( (int)chunk_count, parse );
+    } else if ( chunk_count == 1 ) {
+        parse( 0 );
+    }
+
+    size_t vertices = 0, normals = 0, texcoords = 0, faces = 0;
+    for ( const ObjMeshData& chunk : chunks ) {
+        vertices += chunk.vertices.size();
+        normals += chunk.normals.size();
+        texcoords += chunk.texcoords.size();
+        faces += chunk.faces.size();
+    }
+    out.vertices.reserve( out.vertices.size() + vertices );
+    out.normals.reserve( out.normals.size() + normals );
+    out.texcoords.reserve( out.texcoords.size() + texcoords );
+    out.faces.reserve( out.faces.size() + faces );
+    for ( size_t i = 0; i < chunk_count; i++ ) {
+        append( out.vertices, chunks[i].vertices );
+        append( out.normals, chunks[i].normals );
+        append( out.texcoords, chunks[i].texcoords );
+        append( out.faces, chunks[i].faces );
+        if ( !clean[i] ) {
+            std::cerr << "Error parsing face indices in OBJ file: " << path << std::endl;
+        }
+    }
+
     return true;
-} 
\ No newline at end of file
+}
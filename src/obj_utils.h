@@ -17,6 +17,11 @@ struct ObjMeshData {
     std::vector<Face> faces;
 };
 
-bool load_obj_mesh( const std::string& path, ObjMeshData& out );
+class ThreadPool;
+
+// Parses the vertices, normals, texture coordinates and faces (first three
+// corners, 1-based indices) of an OBJ file. Large files are split into chunks
+// that are parsed in parallel on pool, if one is given.
+bool load_obj_mesh( const std::string& path, ObjMeshData& out, ThreadPool* pool = nullptr );
 
 #endif 
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "material.h"
 #include "transform.h"
 #include "hit.h"
+#include "aabb.h"
 
 class Object {
 public:
@@ -14,6 +15,15 @@ public:
 
     virtual bool intersect( const Ray& ray, Hit& hit ) const = 0;
     virtual Vec get_normal( const Vec& point ) const = 0;
+    // True if the ray hits the object anywhere within [min_t, max_t]. Shadow
+    // rays only need this, so objects can skip computing the hit attributes.
+    virtual bool occluded( const Ray& ray ) const {
+        Hit hit;
+        return intersect( ray, hit ) && hit.t >= ray.min_t && hit.t <= ray.max_t;
+    }
+
+    // World-space bounds, including the object's transform
+    virtual AABB get_bounds() const = 0;
 
     Material* material;
     Transform transform;
@@ -0,0 +1,27 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+// Stateless integer hashing used for reproducible random decisions. A value
+// only depends on the inputs it is derived from (pixel, sample, bounce...),
+// never on which thread got there first.
+inline uint32_t hash_u32( uint32_t x ) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine( uint32_t seed, uint32_t value ) {
+    return hash_u32( seed ^ ( value + 0x9e3779b9u + ( seed << 6 ) + ( seed >> 2 ) ) );
+}
+
+// Uniform float in [0, 1) from the top 24 bits of a hash
+inline float hash_to_float( uint32_t h ) {
+    return ( h >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+#endif
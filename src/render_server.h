@@ -0,0 +1,504 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include "scene.h"
+#include "image_writer.h"
+#include "thread_pool.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Keeps scenes loaded between render requests, so a re-render only pays for
+// tracing. Requests are one text line, a command followed by key=value
+// fields, answered by one line starting with "ok" or "error":
+//
+//   render scene=NAME [xml=N] [position=x,y,z] [lookat=x,y,z] [up=x,y,z]
+//          [fov=F] [width=W] [height=H] [spp=N] [max_spp=N] [spp_threshold=T]
+//          [sampler=stratified|sobol|bluenoise] [seed=N] [time_budget=S]
+//          [format=png|float] [output=PATH]
+//   load scene=NAME [xml=N]
+//   unload scene=NAME
+//   quit
+//
+// NAME is a scene file path, loaded on first use and again whenever the file
+// changes. With xml=N the N bytes after the request line are the scene file
+// itself and NAME only identifies it; sending different text under the same
+// name replaces the scene. Camera and sampling fields override the scene's
+// settings for this render only; time_budget starts from one Sobol sample
+// per pixel unless spp or sampler say otherwise. The image goes to output if
+// given, else it follows the reply
+//
+//   ok width=W height=H rays=R seconds=S spp=A [passes=P] format=F bytes=N
+//
+// as N bytes: a PNG file, or with format=float W*H*3 native-endian 32-bit
+// floats of linear RGB, top row first. A is the average number of samples
+// per pixel, and P the passes completed within a time budget. Meshes are
+// shared by all scenes and stay loaded while the server runs; textures go
+// through the process-wide texture cache and its budget.
+class RenderServer {
+public:
+    explicit RenderServer( ThreadPool& pool ) : pool( pool ) {
+        meshes.pool = &pool;
+    }
+
+    RenderServer( const RenderServer& ) = delete;
+    RenderServer& operator=( const RenderServer& ) = delete;
+
+    ~RenderServer() {
+        for ( auto& entry : scenes ) {
+            delete entry.second.scene;
+        }
+    }
+
+    // Applied to every scene before it is loaded, e.g. command line settings
+    std::function<void( Scene& )> configure_scene;
+    MeshCache meshes;
+
+    // Answers requests from in on out until in ends or a quit request.
+    // Returns false after quit.
+    bool serve( FILE* in, FILE* out ) {
+        std::string line;
+        while ( read_line( in, line ) ) {
+            if ( line.find_first_not_of( " \t" ) == std::string::npos ) {
+                continue;
+            }
+            Request request;
+            std::string error;
+            if ( !parse_request( line, request, error ) ) {
+                reply( out, "error " + error );
+                continue;
+            }
+            if ( request.command == "quit" ) {
+                reply( out, "ok" );
+                return false;
+            }
+            if ( !handle( request, in, out, error ) ) {
+                reply( out, "error " + error );
+            }
+        }
+        return true;
+    }
+
+    // Serves one client connection after the other on a Unix domain socket
+    // at path until a client sends quit
+    bool serve_socket( const std::string& path ) {
+#ifdef _WIN32
+        std::cerr << "Error: serving on a socket needs Unix domain sockets, use --serve instead" << std::endl;
+        return false;
+#else
+        sockaddr_un address;
+        std::memset( &address, 0, sizeof( address ) );
+        address.sun_family = AF_UNIX;
+        if ( path.size() >= sizeof( address.sun_path ) ) {
+            std::cerr << "Error: socket path too long: " << path << std::endl;
+            return false;
+        }
+        std::strcpy( address.sun_path, path.c_str() );
+
+        // A client going away mid-reply must not end the server
+        std::signal( SIGPIPE, SIG_IGN );
+
+        // Here I remove the socket an earlier server left behind
+        std::error_code ignored;
+        if ( std::filesystem::is_socket( path, ignored ) ) {
+            std::filesystem::remove( path, ignored );
+        }
+
+        int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if ( listener < 0 || bind( listener, (sockaddr*)&address, sizeof( address ) ) != 0 || listen( listener, 4 ) != 0 ) {
+            std::cerr << "Error: can't listen on socket " << path << ": " << std::strerror( errno ) << std::endl;
+            if ( listener >= 0 ) {
+                close( listener );
+            }
+            return false;
+        }
+        std::cout << "Listening on " << path << std::endl;
+
+        bool running = true;
+        while ( running ) {
+            int connection = accept( listener, nullptr, nullptr );
+            if ( connection < 0 ) {
+                if ( errno == EINTR ) {
+                    continue;
+                }
+                std::cerr << "Error: accept failed: " << std::strerror( errno ) << std::endl;
+                break;
+            }
+            FILE* in = fdopen( connection, "rb" );
+            FILE* out = fdopen( dup( connection ), "wb" );
+            if ( in && out ) {
+                running = serve( in, out );
+            }
+            if ( in ) {
+                std::fclose( in );
+            }
+            if ( out ) {
+                std::fclose( out );
+            }
+        }
+        close( listener );
+        std::filesystem::remove( path, ignored );
+        return true;
+#endif
+    }
+
+private:
+    // The scene settings sampling fields can override
+    struct Sampling {
+        int min_samples;
+        int max_samples;
+        float threshold;
+        Sampler sampler;
+        double time_budget;
+
+        static Sampling of( const Scene& scene ) {
+            return { scene.min_samples, scene.max_samples, scene.sample_threshold, scene.sampler, scene.time_budget };
+        }
+
+        void apply( Scene& scene ) const {
+            scene.min_samples = min_samples;
+            scene.max_samples = std::max( max_samples, min_samples );
+            scene.sample_threshold = threshold;
+            scene.sampler = sampler;
+            scene.time_budget = time_budget;
+        }
+    };
+
+    struct Request {
+        std::string command;
+        std::map<std::string, std::string> fields;
+    };
+
+    struct LoadedScene {
+        Scene* scene;
+        // What it was loaded from: the file's modification time, or the text
+        // sent with a request
+        bool from_text;
+        std::filesystem::file_time_type modified;
+        std::string text;
+    };
+
+    static const long max_text_size = 256L << 20;
+
+    ThreadPool& pool;
+    std::map<std::string, LoadedScene> scenes;
+
+    bool handle( const Request& request, FILE* in, FILE* out, std::string& error ) {
+        // Read the scene text first, so the stream stays in step even if the
+        // request turns out to be invalid
+        std::string text;
+        bool has_text = request.fields.count( "xml" ) > 0;
+        if ( has_text ) {
+            long size = 0;
+            if ( !parse_int( request.fields.at( "xml" ), size ) || size < 0 || size > max_text_size ) {
+                error = "invalid xml size";
+                return false;
+            }
+            text.resize( size );
+            if ( size > 0 && std::fread( &text[0], 1, size, in ) != (size_t)size ) {
+                error = "scene text ends early";
+                return false;
+            }
+        }
+
+        auto name = request.fields.find( "scene" );
+        if ( request.command != "render" && request.command != "load" && request.command != "unload" ) {
+            error = "unknown command " + request.command;
+            return false;
+        }
+        if ( name == request.fields.end() ) {
+            error = "missing scene";
+            return false;
+        }
+
+        if ( request.command == "unload" ) {
+            auto entry = scenes.find( name->second );
+            if ( entry == scenes.end() ) {
+                error = "scene not loaded: " + name->second;
+                return false;
+            }
+            delete entry->second.scene;
+            scenes.erase( entry );
+            reply( out, "ok" );
+            return true;
+        }
+
+        double load_seconds = 0.0;
+        Scene* scene = find_scene( name->second, has_text ? &text : nullptr, load_seconds, error );
+        if ( !scene ) {
+            return false;
+        }
+        std::ostringstream loaded;
+        if ( load_seconds > 0.0 ) {
+            loaded << " load_seconds=" << load_seconds;
+        }
+        if ( request.command == "load" ) {
+            reply( out, "ok" + loaded.str() );
+            return true;
+        }
+
+        Camera view = scene->camera;
+        Sampling sampling = Sampling::of( *scene );
+        if ( !parse_camera( request, view, error ) || !parse_sampling( request, sampling, error ) ) {
+            return false;
+        }
+        std::string format = "png";
+        if ( request.fields.count( "format" ) ) {
+            format = request.fields.at( "format" );
+            if ( format != "png" && format != "float" ) {
+                error = "unknown format " + format;
+                return false;
+            }
+        }
+
+        Camera base = scene->camera;
+        Sampling base_sampling = Sampling::of( *scene );
+        scene->camera = view;
+        sampling.apply( *scene );
+        std::vector<Vec> pixels;
+        double seconds, samples_per_pixel;
+        uint64_t rays = scene->render_image( pool, pixels, seconds, samples_per_pixel );
+        scene->camera = base;
+        base_sampling.apply( *scene );
+
+        std::vector<unsigned char> bytes;
+        if ( format == "png" ) {
+            if ( !ImageWriter::encode_png( pixels, view.width, view.height, bytes ) ) {
+                error = "PNG encoding failed";
+                return false;
+            }
+        } else {
+            bytes.resize( pixels.size() * 3 * sizeof( float ) );
+            float* values = (float*)bytes.data();
+            for ( size_t i = 0; i < pixels.size(); i++ ) {
+                values[i * 3] = pixels[i].x;
+                values[i * 3 + 1] = pixels[i].y;
+                values[i * 3 + 2] = pixels[i].z;
+            }
+        }
+
+        std::ostringstream header;
+        header << "ok width=" << view.width << " height=" << view.height << " rays=" << rays << " seconds=" << seconds
+               << " spp=" << samples_per_pixel;
+        if ( sampling.time_budget > 0.0 ) {
+            header << " passes=" << scene->render_passes();
+        }
+        header << loaded.str() << " format=" << format;
+        auto output = request.fields.find( "output" );
+        if ( output != request.fields.end() ) {
+            std::filesystem::path path( output->second );
+            std::error_code ignored;
+            std::filesystem::create_directories( path.parent_path(), ignored );
+            std::ofstream file( path, std::ios::binary );
+            if ( !file.write( (const char*)bytes.data(), bytes.size() ) ) {
+                error = "can't write " + output->second;
+                return false;
+            }
+            header << " output=" << output->second;
+            reply( out, header.str() );
+            return true;
+        }
+        header << " bytes=" << bytes.size();
+        reply( out, header.str(), &bytes );
+        return true;
+    }
+
+    // The loaded scene called name, (re)loaded if it is new or its file or
+    // text changed. A scene sent as text is reused by later requests that
+    // only give its name. load_seconds is set if it was loaded.
+    Scene* find_scene( const std::string& name, const std::string* text, double& load_seconds, std::string& error ) {
+        auto entry = scenes.find( name );
+        if ( !text && entry != scenes.end() && entry->second.from_text ) {
+            return entry->second.scene;
+        }
+
+        std::filesystem::file_time_type modified;
+        if ( !text ) {
+            std::error_code failed;
+            modified = std::filesystem::last_write_time( name, failed );
+            if ( failed ) {
+                error = "can't read scene file " + name;
+                return nullptr;
+            }
+        }
+
+        if ( entry != scenes.end() ) {
+            bool unchanged = text ? entry->second.from_text && entry->second.text == *text
+                                  : entry->second.modified == modified;
+            if ( unchanged ) {
+                return entry->second.scene;
+            }
+            delete entry->second.scene;
+            scenes.erase( entry );
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        Scene* scene = new Scene();
+        scene->share_assets( meshes, TextureCache::global() );
+        if ( configure_scene ) {
+            configure_scene( *scene );
+        }
+        bool ok = text ? scene->load_text( *text, pool ) : scene->load( name, pool );
+        if ( !ok ) {
+            delete scene;
+            error = "failed to load scene " + name;
+            return nullptr;
+        }
+        load_seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+        scenes[name] = { scene, text != nullptr, modified, text ? *text : std::string() };
+        return scene;
+    }
+
+    static bool parse_camera( const Request& request, Camera& camera, std::string& error ) {
+        for ( const auto& field : request.fields ) {
+            const std::string& key = field.first;
+            const std::string& value = field.second;
+            bool ok = true;
+            if ( key == "position" ) {
+                ok = parse_vec( value, camera.position );
+            } else if ( key == "lookat" ) {
+                ok = parse_vec( value, camera.look_at );
+            } else if ( key == "up" ) {
+                ok = parse_vec( value, camera.up );
+            } else if ( key == "fov" ) {
+                ok = parse_float( value, camera.fov ) && camera.fov > 0.0f && camera.fov < 180.0f;
+            } else if ( key == "width" || key == "height" ) {
+                long size = 0;
+                ok = parse_int( value, size ) && size > 0 && size <= 16384;
+                ( key == "width" ? camera.width : camera.height ) = (int)size;
+            } else if ( key != "scene" && key != "xml" && key != "format" && key != "output" &&
+                        key != "spp" && key != "max_spp" && key != "spp_threshold" && key != "sampler" &&
+                        key != "seed" && key != "time_budget" ) {
+                error = "unknown field " + key;
+                return false;
+            }
+            if ( !ok ) {
+                error = "invalid " + key + " " + value;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool parse_sampling( const Request& request, Sampling& sampling, std::string& error ) {
+        for ( const auto& field : request.fields ) {
+            const std::string& key = field.first;
+            const std::string& value = field.second;
+            bool ok = true;
+            if ( key == "spp" || key == "max_spp" ) {
+                long count = 0;
+                ok = parse_int( value, count ) && count > 0 && count <= 65536;
+                ( key == "spp" ? sampling.min_samples : sampling.max_samples ) = (int)count;
+            } else if ( key == "spp_threshold" ) {
+                ok = parse_float( value, sampling.threshold ) && sampling.threshold >= 0.0f;
+            } else if ( key == "time_budget" ) {
+                float seconds = 0.0f;
+                ok = parse_float( value, seconds ) && seconds >= 0.0f;
+                sampling.time_budget = seconds;
+                // Defaults as for --time-budget: one sample per pixel first,
+                // then as many as there is time for
+                if ( seconds > 0.0f && !request.fields.count( "spp" ) ) {
+                    sampling.min_samples = 1;
+                }
+                if ( seconds > 0.0f && !request.fields.count( "max_spp" ) ) {
+                    sampling.max_samples = sampling.min_samples;
+                }
+                if ( seconds > 0.0f && !request.fields.count( "sampler" ) ) {
+                    sampling.sampler.type = Sampler::SOBOL;
+                }
+            } else if ( key == "sampler" ) {
+                ok = Sampler::parse_type( value, sampling.sampler.type );
+            } else if ( key == "seed" ) {
+                long seed = 0;
+                ok = parse_int( value, seed ) && seed >= 0;
+                sampling.sampler.seed = (uint32_t)seed;
+            }
+            if ( !ok ) {
+                error = "invalid " + key + " " + value;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool parse_request( const std::string& line, Request& request, std::string& error ) {
+        std::istringstream tokens( line );
+        if ( !( tokens >> request.command ) ) {
+            error = "empty request";
+            return false;
+        }
+        std::string token;
+        while ( tokens >> token ) {
+            size_t equals = token.find( '=' );
+            if ( equals == std::string::npos || equals == 0 ) {
+                error = "expected key=value, got " + token;
+                return false;
+            }
+            request.fields[token.substr( 0, equals )] = token.substr( equals + 1 );
+        }
+        return true;
+    }
+
+    static bool parse_float( const std::string& text, float& value ) {
+        char* end;
+        value = std::strtof( text.c_str(), &end );
+        return !text.empty() && *end == '\0';
+    }
+
+    static bool parse_int( const std::string& text, long& value ) {
+        char* end;
+        value = std::strtol( text.c_str(), &end, 10 );
+        return !text.empty() && *end == '\0';
+    }
+
+    // "x,y,z"
+    static bool parse_vec( const std::string& text, Vec& value ) {
+        float x, y, z;
+        int end = 0;
+        if ( std::sscanf( text.c_str(), "%f,%f,%f%n", &x, &y, &z, &end ) != 3 || end != (int)text.size() ) {
+            return false;
+        }
+        value = Vec( x, y, z );
+        return true;
+    }
+
+    // One line without its line break; false at the end of the stream
+    static bool read_line( FILE* in, std::string& line ) {
+        line.clear();
+        int c;
+        while ( ( c = std::fgetc( in ) ) != EOF && c != '\n' ) {
+            line += (char)c;
+        }
+        if ( !line.empty() && line.back() == '\r' ) {
+            line.pop_back();
+        }
+        return c != EOF || !line.empty();
+    }
+
+    static void reply( FILE* out, const std::string& line, const std::vector<unsigned char>* payload = nullptr ) {
+        std::fputs( line.c_str(), out );
+        std::fputc( '\n', out );
+        if ( payload && !payload->empty() ) {
+            std::fwrite( payload->data(), 1, payload->size(), out );
+        }
+        std::fflush( out );
+    }
+};
+
+#endif
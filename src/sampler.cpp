@@ -0,0 +1,110 @@
+#include "sampler.h"
+#include <vector>
+
+namespace {
+
+const int tile_size = 64;
+const int tile_pixels = tile_size * tile_size;
+// Gaussian energy falloff of Ulichney's void-and-cluster method, cut off
+// where it no longer matters
+const float sigma = 1.5f;
+const int radius = 7;
+
+struct Pattern {
+    std::vector<char> on;
+    std::vector<float> energy;
+
+    Pattern() : on( tile_pixels, 0 ), energy( tile_pixels, 0.0f ) {}
+
+    void set( int pixel, bool value ) {
+        on[pixel] = value;
+        float sign = value ? 1.0f : -1.0f;
+        int x = pixel % tile_size;
+        int y = pixel / tile_size;
+        for ( int dy = -radius; dy <= radius; dy++ ) {
+            for ( int dx = -radius; dx <= radius; dx++ ) {
+                int wx = ( x + dx + tile_size ) % tile_size;
+                int wy = ( y + dy + tile_size ) % tile_size;
+                energy[wy * tile_size + wx] += sign * std::exp( -( dx * dx + dy * dy ) / ( 2.0f * sigma * sigma ) );
+            }
+        }
+    }
+
+    // The set pixel with the most energy around it
+    int tightest_cluster() const {
+        int best = -1;
+        for ( int i = 0; i < tile_pixels; i++ ) {
+            if ( on[i] && ( best < 0 || energy[i] > energy[best] ) ) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // The free pixel with the least energy around it
+    int largest_void() const {
+        int best = -1;
+        for ( int i = 0; i < tile_pixels; i++ ) {
+            if ( !on[i] && ( best < 0 || energy[i] < energy[best] ) ) {
+                best = i;
+            }
+        }
+        return best;
+    }
+};
+
+// Ranks every pixel of the tile so that the pixels below any threshold form
+// an evenly spread pattern, and returns the ranks as values in (0, 1)
+std::vector<float> void_and_cluster( uint32_t seed ) {
+    // Here I start from a random tenth of the pixels and move points from
+    // the tightest cluster to the largest void until that changes nothing
+    Pattern initial;
+    int initial_count = tile_pixels / 10;
+    for ( uint32_t i = 0, placed = 0; placed < (uint32_t)initial_count; i++ ) {
+        int pixel = hash_combine( seed, i ) % tile_pixels;
+        if ( !initial.on[pixel] ) {
+            initial.set( pixel, true );
+            placed++;
+        }
+    }
+    for ( int step = 0; step < tile_pixels; step++ ) {
+        int cluster = initial.tightest_cluster();
+        initial.set( cluster, false );
+        int gap = initial.largest_void();
+        initial.set( gap, true );
+        if ( gap == cluster ) {
+            break;
+        }
+    }
+
+    std::vector<int> rank( tile_pixels );
+    Pattern pattern = initial;
+    for ( int count = initial_count; count > 0; count-- ) {
+        int cluster = pattern.tightest_cluster();
+        pattern.set( cluster, false );
+        rank[cluster] = count - 1;
+    }
+    pattern = initial;
+    for ( int count = initial_count; count < tile_pixels; count++ ) {
+        int gap = pattern.largest_void();
+        pattern.set( gap, true );
+        rank[gap] = count;
+    }
+
+    std::vector<float> values( tile_pixels );
+    for ( int i = 0; i < tile_pixels; i++ ) {
+        values[i] = ( rank[i] + 0.5f ) / tile_pixels;
+    }
+    return values;
+}
+
+}
+
+void Sampler::blue_noise( int x, int y, float& u, float& v ) {
+    // Built once, on first use; two independent tiles for the two axes
+    static const std::vector<float> tile_u = void_and_cluster( 0x6b6e6f75u );
+    static const std::vector<float> tile_v = void_and_cluster( 0x2f1a0c37u );
+    int pixel = ( y % tile_size ) * tile_size + x % tile_size;
+    u = tile_u[pixel];
+    v = tile_v[pixel];
+}
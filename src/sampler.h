@@ -0,0 +1,171 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "random.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+// Places the camera samples inside a pixel. Every offset is a pure function
+// of the pixel, the sample index and the seed, so any thread or machine
+// rendering a pixel picks the same positions, and a pixel can take any
+// number of samples, more of them later without redoing the first ones.
+//
+// STRATIFIED spreads each batch of samples over a jittered grid whose rows
+// and columns are also stratified on their own (correlated multi-jittered
+// sampling); a batch is the base samples, then each adaptive round. SOBOL
+// uses the Sobol sequence, scrambled per pixel, and is best at power of two
+// counts. BLUE_NOISE shifts one Sobol sequence by a blue noise offset per
+// pixel, which moves the leftover error to high frequencies where it reads
+// as fine grain instead of blotches.
+struct Sampler {
+    enum Type {
+        STRATIFIED,
+        SOBOL,
+        BLUE_NOISE
+    };
+
+    Type type = STRATIFIED;
+    // Mixed into every pixel's seed; different seeds give independent renders
+    uint32_t seed = 0;
+
+    static bool parse_type( const std::string& name, Type& type ) {
+        if ( name == "stratified" ) {
+            type = STRATIFIED;
+        } else if ( name == "sobol" ) {
+            type = SOBOL;
+        } else if ( name == "bluenoise" ) {
+            type = BLUE_NOISE;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    uint32_t pixel_seed( int x, int y ) const {
+        return hash_combine( hash_combine( hash_u32( seed ), (uint32_t)x ), (uint32_t)y );
+    }
+
+    // Seed for the random decisions along the path of sample k of a pixel
+    uint32_t sample_seed( int x, int y, int k ) const {
+        return hash_combine( pixel_seed( x, y ), (uint32_t)k );
+    }
+
+    // Position of sample k inside pixel (x, y), both coordinates in [0, 1).
+    // base is the number of samples every pixel takes first.
+    void offset( int x, int y, int k, int base, float& offset_x, float& offset_y ) const {
+        uint32_t pixel = pixel_seed( x, y );
+        if ( type == STRATIFIED ) {
+            // Here I find the batch sample k belongs to: the base samples,
+            // then rounds that double the count
+            int start = 0;
+            int size = base;
+            while ( k >= start + size ) {
+                start += size;
+                size = start;
+            }
+            correlated_multi_jitter( k - start, size, hash_combine( pixel, (uint32_t)start ), offset_x, offset_y );
+        } else if ( type == SOBOL ) {
+            offset_x = to_float( owen_scramble( reverse_bits( (uint32_t)k ), hash_combine( pixel, 0x5eedu ) ) );
+            offset_y = to_float( owen_scramble( sobol_second( (uint32_t)k ), hash_combine( pixel, 0x5eeeu ) ) );
+        } else {
+            float shift_x, shift_y;
+            blue_noise( x + ( seed & 63 ), y + ( ( seed >> 6 ) & 63 ), shift_x, shift_y );
+            offset_x = to_float( reverse_bits( (uint32_t)k ) ) + shift_x;
+            offset_y = to_float( sobol_second( (uint32_t)k ) ) + shift_y;
+            offset_x -= floorf( offset_x );
+            offset_y -= floorf( offset_y );
+        }
+    }
+
+    // Sample s of count in [0, 1)^2 from Kensler's correlated multi-jittered
+    // sampling: a permuted m x n grid with one sample per row and column of
+    // the fine grid
+    static void correlated_multi_jitter( int s, int count, uint32_t p, float& u, float& v ) {
+        int m = std::max( 1, (int)std::sqrt( (float)count ) );
+        int n = ( count + m - 1 ) / m;
+        s = (int)permute( (uint32_t)s, (uint32_t)count, p * 0x51633e2du );
+        int sx = (int)permute( (uint32_t)( s % m ), (uint32_t)m, p * 0x68bc21ebu );
+        int sy = (int)permute( (uint32_t)( s / m ), (uint32_t)n, p * 0x02e5be93u );
+        float jx = hash_to_float( hash_combine( p, (uint32_t)s * 2 ) );
+        float jy = hash_to_float( hash_combine( p, (uint32_t)s * 2 + 1 ) );
+        u = std::min( ( sx + ( sy + jx ) / n ) / m, 0.99999994f );
+        v = std::min( ( s + jy ) / count, 0.99999994f );
+    }
+
+    // Random permutation of [0, length) picked by p, evaluated at i
+    static uint32_t permute( uint32_t i, uint32_t length, uint32_t p ) {
+        uint32_t w = length - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do {
+            i ^= p;
+            i *= 0xe170893du;
+            i ^= p >> 16;
+            i ^= ( i & w ) >> 4;
+            i ^= p >> 8;
+            i *= 0x0929eb3fu;
+            i ^= p >> 23;
+            i ^= ( i & w ) >> 1;
+            i *= 1 | p >> 27;
+            i *= 0x6935fa69u;
+            i ^= ( i & w ) >> 11;
+            i *= 0x74dcb303u;
+            i ^= ( i & w ) >> 2;
+            i *= 0x9e501cc3u;
+            i ^= ( i & w ) >> 2;
+            i *= 0xc860a3dfu;
+            i &= w;
+            i ^= i >> 5;
+        } while ( i >= length );
+        return ( i + p ) % length;
+    }
+
+    // First Sobol dimension (the van der Corput sequence) as 32-bit fraction
+    static uint32_t reverse_bits( uint32_t x ) {
+        x = ( x << 16 ) | ( x >> 16 );
+        x = ( ( x & 0x00ff00ffu ) << 8 ) | ( ( x & 0xff00ff00u ) >> 8 );
+        x = ( ( x & 0x0f0f0f0fu ) << 4 ) | ( ( x & 0xf0f0f0f0u ) >> 4 );
+        x = ( ( x & 0x33333333u ) << 2 ) | ( ( x & 0xccccccccu ) >> 2 );
+        x = ( ( x & 0x55555555u ) << 1 ) | ( ( x & 0xaaaaaaaau ) >> 1 );
+        return x;
+    }
+
+    // Second Sobol dimension as 32-bit fraction
+    static uint32_t sobol_second( uint32_t k ) {
+        uint32_t result = 0;
+        for ( uint32_t direction = 1u << 31; k; k >>= 1, direction ^= direction >> 1 ) {
+            if ( k & 1 ) {
+                result ^= direction;
+            }
+        }
+        return result;
+    }
+
+    // Owen scrambling of a 32-bit fraction: each bit is flipped depending on
+    // the bits above it, which keeps the stratification of the sequence
+    // (Burley's hash based version of the Laine-Karras permutation)
+    static uint32_t owen_scramble( uint32_t x, uint32_t seed ) {
+        x = reverse_bits( x );
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverse_bits( x );
+    }
+
+    static float to_float( uint32_t fraction ) {
+        return ( fraction >> 8 ) * ( 1.0f / 16777216.0f );
+    }
+
+    // Two blue noise values in [0, 1) for pixel (x, y), from a 64x64 tile
+    // that repeats over the image
+    static void blue_noise( int x, int y, float& u, float& v );
+};
+
+#endif
@@ -1,6 +1,22 @@
 #include "scene.h"
 #include "scene_parser.h"
 
-bool Scene::load( const std::string& filename ) {
-    return SceneParser::parse( *this, filename );
+bool Scene::load( const std::string& filename, ThreadPool& pool ) {
+    own_mesh_cache.pool = &pool;
+    if ( !SceneParser::parse( *this, filename, &pool ) ) {
+        return false;
+    }
+    light_set.compile( lights );
+    build_bvh();
+    return true;
+}
+
+bool Scene::load_text( const std::string& xml, ThreadPool& pool ) {
+    own_mesh_cache.pool = &pool;
+    if ( !SceneParser::parse_text( *this, xml, &pool ) ) {
+        return false;
+    }
+    light_set.compile( lights );
+    build_bvh();
+    return true;
 } 
\ No newline at end of file
@@ -3,19 +3,31 @@
 
 #include "camera.h"
 #include "object.h"
+#include "mesh.h"
 #include "light.h"
 #include "material.h"
-#include "third_party/stb_image_write.h"
+#include "bvh.h"
+#include "thread_pool.h"
+#include "random.h"
+#include "sampler.h"
+#include "animation.h"
+#include "image_writer.h"
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <utility>
 #include <filesystem>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
 
 class SceneParser;
 
 class Scene {
 public:
-    Scene() : max_bounces(5) {}
+    Scene() : mesh_cache( &own_mesh_cache ), texture_cache( &TextureCache::global() ), max_bounces(5) {}
 
     ~Scene() {
         for ( Object* obj : objects ) {
@@ -29,72 +41,130 @@ public:
         }
     }
 
-    bool load( const std::string& filename );
+    // Parses the scene file and builds everything needed for rendering. The
+    // pool is used for loading large assets.
+    bool load( const std::string& filename, ThreadPool& pool );
+    // Same for the text of a scene file
+    bool load_text( const std::string& xml, ThreadPool& pool );
 
-    void render( const std::string& output_filename ) {
-        output_file = output_filename;
-        std::vector<Vec> pixels( camera.width * camera.height );
-        const int samples_per_pixel = 4;
-
-        std::cout << "Rendering " << camera.width << "x" << camera.height << " image..." << std::endl;
-
-        for ( int y = 0; y < camera.height; y++ ) {
-            // Progress output every 10% of rows
-            if ( y % (camera.height / 10) == 0 ) {
-                int progress = (y * 100) / camera.height;
-                std::cout << "Progress: " << progress << "% (row " << y << "/" << camera.height << ")" << std::endl;
-            }
-            
-            for ( int x = 0; x < camera.width; x++ ) {
-                Vec pixel_color( 0, 0, 0 );
-                
-                for ( int sy = 0; sy < 2; sy++ ) {
-                    for ( int sx = 0; sx < 2; sx++ ) {
-                        float offset_x = ( sx + 0.5f ) / 2.0f;
-                        float offset_y = ( sy + 0.5f ) / 2.0f;
-                        
-                        Ray ray = camera.get_ray( x + offset_x, y + offset_y );
-                        ray.min_t = 0.001f;  // Avoid self-intersection
-                        ray.max_t = 1000.0f; // Reasonable scene bounds
-                        Vec sample_color = trace_ray( ray, 0 );
-                        pixel_color = pixel_color + sample_color;
-                    }
-                }
-                
-                // Here I handle the coordinate system
-                int flipped_y = camera.height - 1 - y;
-                pixels[flipped_y * camera.width + x] = pixel_color * ( 1.0f / samples_per_pixel );
-            }
+    // Builds the top-level BVH over the world-space bounds of all objects.
+    // Called once the parser has filled in objects.
+    void build_bvh() {
+        bvh.build( object_bounds(), 2 );
+        if ( bvh_options.layout == BVHBuildOptions::WIDE ) {
+            bvh.compress();
+        }
+        bvh_build_cost = bvh.sah_cost();
+        std::cout << "Built BVH over " << objects.size() << " objects (" << bvh.node_count() << " "
+                  << ( bvh.is_wide() ? "wide " : "" ) << "nodes)" << std::endl;
+    }
+
+    // Brings the top-level BVH up to date after object transforms changed.
+    // The tree is refitted to the new bounds, and only built again once its
+    // SAH cost exceeds bvh_rebuild_ratio times the cost it had when built.
+    // Returns true if it was built again.
+    bool update_bvh() {
+        if ( bvh.refit( object_bounds() ) && bvh.sah_cost() <= bvh_build_cost * bvh_rebuild_ratio ) {
+            return false;
         }
+        build_bvh();
+        return true;
+    }
+
+    // Renders the image tile by tile on the given pool. Every pixel only
+    // depends on its own samples, so the result is the same for any number of
+    // threads.
+    void render( const std::string& output_filename, ThreadPool& pool ) {
+        output_file = output_filename;
+        std::cout << "Rendering " << camera.width << "x" << camera.height << " image on "
+                  << pool.size() << " threads..." << std::endl;
 
-        std::cout << "Rendering complete. Saving image..." << std::endl;
+        std::vector<Vec> pixels;
+        uint64_t rays = render_pixels( pool, pixels, true );
+        double seconds = last_render_seconds;
+        std::cout << "Rendering complete: " << rays << " rays in " << seconds << " s ("
+                  << rays / seconds * 1e-6 << " Mrays/s, " << last_samples_per_pixel
+                  << " samples/pixel). Saving image..." << std::endl;
+        if ( texture_cache->size() > 0 ) {
+            std::cout << "Textures: " << texture_cache->decoded() << " of " << texture_cache->size() << " decoded, "
+                      << texture_cache->resident_bytes() / 1024 << " KB" << std::endl;
+        }
         save_image( pixels );
         std::cout << "Image saved to: " << output_filename << std::endl;
     }
 
-    void save_image( const std::vector<Vec>& pixels ) {
-        std::vector<unsigned char> data( pixels.size() * 3 );
-        for ( size_t i = 0; i < pixels.size(); i++ ) {
-            // Clamp values
-            float r = std::max( 0.0f, std::min( 1.0f, pixels[i].x ) );
-            float g = std::max( 0.0f, std::min( 1.0f, pixels[i].y ) );
-            float b = std::max( 0.0f, std::min( 1.0f, pixels[i].z ) );
-            
-            // Here I prepare colors for display
-            r = std::pow( r, 1.0f / 2.2f );
-            g = std::pow( g, 1.0f / 2.2f );
-            b = std::pow( b, 1.0f / 2.2f );
-            
-            data[i * 3] = (unsigned char)( r * 255 );
-            data[i * 3 + 1] = (unsigned char)( g * 255 );
-            data[i * 3 + 2] = (unsigned char)( b * 255 );
+    // Renders frames [first_frame, last_frame] of the animation to
+    // frame_path( output_filename, frame ). Meshes, textures and the BVHs
+    // stay loaded; between frames only the camera and the animated
+    // transforms change and the top-level BVH is refitted. Each frame is
+    // encoded on a separate thread while the next one renders.
+    void render_animation( const std::string& output_filename, int first_frame, int last_frame, ThreadPool& pool ) {
+        std::cout << "Rendering frames " << first_frame << " to " << last_frame << " at " << camera.width << "x"
+                  << camera.height << " on " << pool.size() << " threads..." << std::endl;
+
+        Camera base_camera = camera;
+        ImageWriter writer;
+        uint64_t total_rays = 0;
+        double render_seconds = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        for ( int frame = first_frame; frame <= last_frame; frame++ ) {
+            camera = animation.camera_at( frame, base_camera );
+            for ( const ObjectTrack& track : animation.object_tracks ) {
+                objects[track.object]->transform = Animation::transform_at( track, frame );
+            }
+            if ( !animation.object_tracks.empty() ) {
+                update_bvh();
+            }
+
+            std::vector<Vec> pixels;
+            uint64_t rays = render_pixels( pool, pixels, false );
+            total_rays += rays;
+            render_seconds += last_render_seconds;
+            std::string path = frame_path( output_filename, frame );
+            std::cout << "Frame " << frame << ": " << rays << " rays in " << last_render_seconds << " s, "
+                      << last_samples_per_pixel << " samples/pixel";
+            if ( time_budget > 0.0 ) {
+                std::cout << ", " << last_render_passes << " passes";
+            }
+            std::cout << " -> " << path << std::endl;
+            writer.write( std::move( pixels ), camera.width, camera.height, path );
         }
-        
-        // Create output directory if it doesn't exist
-        std::filesystem::path file_path( output_file );
-        std::filesystem::create_directories( file_path.parent_path() );
-        
-        stbi_write_png( output_file.c_str(), camera.width, camera.height, 3, data.data(), camera.width * 3 );
+        writer.finish();
+        camera = base_camera;
+
+        double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+        int frames = last_frame - first_frame + 1;
+        std::cout << "Rendered " << frames << " frames in " << seconds << " s (" << render_seconds << " s rendering, "
+                  << total_rays / render_seconds * 1e-6 << " Mrays/s)" << std::endl;
+    }
+
+    // Renders the current camera view into pixels (linear colour, top row
+    // first) without writing anything. Returns the number of rays traced;
+    // the render time is left in seconds and the average sample count per
+    // pixel in samples_per_pixel.
+    uint64_t render_image( ThreadPool& pool, std::vector<Vec>& pixels, double& seconds, double& samples_per_pixel ) {
+        uint64_t rays = render_pixels( pool, pixels, false );
+        seconds = last_render_seconds;
+        samples_per_pixel = last_samples_per_pixel;
+        return rays;
+    }
+
+    // Passes over the image in the last render, 1 unless it had a time budget
+    int render_passes() const {
+        return last_render_passes;
+    }
+
+    // "out.png" becomes "out_0007.png" for frame 7
+    static std::string frame_path( const std::string& output_filename, int frame ) {
+        std::filesystem::path path( output_filename );
+        char number[16];
+        std::snprintf( number, sizeof( number ), "_%04d", frame );
+        std::filesystem::path name = path.stem().string() + number + path.extension().string();
+        return ( path.parent_path() / name ).string();
+    }
+
+    void save_image( const std::vector<Vec>& pixels ) {
+        ImageWriter::write_png( pixels, camera.width, camera.height, output_file );
     }
 
     std::string output_file;
@@ -102,24 +172,619 @@ public:
     Camera camera;
     std::vector<Object*> objects;
     std::vector<Light*> lights;
+    // lights compiled for shading, see LightSet
+    LightSet light_set;
     std::vector<Material*> materials;
+    // Meshes and textures are loaded through these caches. Meshes go to the
+    // scene's own cache and textures to the process-wide one, unless
+    // share_assets() points them at other caches.
+    MeshCache* mesh_cache;
+    TextureCache* texture_cache;
+    // How the BVHs are built. Each field, once fixed (by the command line),
+    // can't be changed by the scene file any more.
+    BVHBuildOptions bvh_options;
+    bool bvh_builder_fixed = false;
+    bool bvh_layout_fixed = false;
+    bool bvh_treelets_fixed = false;
+    // Camera and transform keyframes, empty for a still image
+    Animation animation;
     Vec ambientLight;
     int max_bounces;
+    BVH bvh;
+    // update_bvh() builds again once refitting made the top-level BVH this
+    // much more expensive than right after its last build
+    float bvh_rebuild_ratio = 1.5f;
+    // Trace the primary rays of each tile as one frustum-culled packet
+    bool packet_tracing = true;
+    // Reflection/transmission branches contributing less than this fraction
+    // of a sample are not traced (0 traces everything up to max_bounces)
+    float min_ray_weight = 0.001f;
+    // Instead of dropping such branches, keep them at random with probability
+    // proportional to their weight (unbiased, but adds some noise)
+    bool russian_roulette = false;
+    // Samples per pixel: every pixel gets min_samples, and pixels whose
+    // luminance mean is uncertain by more than sample_threshold (standard
+    // error, on the 0..1 display scale) get more, up to max_samples
+    int min_samples = 4;
+    int max_samples = 4;
+    float sample_threshold = 0.01f;
+    // Where in the pixel the samples go
+    Sampler sampler;
+    // Seconds a render may take: a first pass with min_samples per pixel,
+    // then passes refining the noisiest tiles until the time is up. 0 renders
+    // to completion.
+    double time_budget = 0.0;
+
+    // Loads meshes and textures through the given caches instead of the
+    // scene's own, e.g. to share them between scenes. Call before load().
+    void share_assets( MeshCache& meshes, TextureCache& textures ) {
+        mesh_cache = &meshes;
+        texture_cache = &textures;
+    }
 
 private:
-    Vec trace_ray( const Ray& ray, int depth = 0 ) {
-        if ( depth > max_bounces ) {
-            return background_color;
+    MeshCache own_mesh_cache;
+
+    static const int tile_size = 8;
+
+    // SAH cost of the top-level BVH right after its last build
+    float bvh_build_cost = 0.0f;
+    double last_render_seconds = 0.0;
+    // Cone spread of camera rays: the angle between neighbouring samples
+    float primary_spread = 0.0f;
+    // Samples per pixel over the last render
+    double last_samples_per_pixel = 0.0;
+    // Passes over the image in the last render, counting the first
+    int last_render_passes = 0;
+
+    Ray primary_ray( int x, int y, int sample ) const {
+        float offset_x, offset_y;
+        sampler.offset( x, y, sample, std::max( min_samples, 1 ), offset_x, offset_y );
+
+        Ray ray = camera.get_ray( x + offset_x, y + offset_y );
+        ray.min_t = 0.001f;  // Avoid self-intersection
+        ray.max_t = 1000.0f; // Reasonable scene bounds
+        return ray;
+    }
+
+    // Samples taken so far for the pixels of one tile
+    struct TileSamples {
+        int x0, y0, x1, y1;
+        std::vector<Vec> sums;
+        // Luminance sums for the error estimate
+        std::vector<float> lum_sums;
+        std::vector<float> lum_squares;
+        std::vector<int> taken;
+    };
+
+    // Renders the current camera view into pixels, top row first, and
+    // returns the number of rays traced. The time it took is left in
+    // last_render_seconds and the average sample count per pixel in
+    // last_samples_per_pixel. With a time_budget the image is refined in
+    // passes until the budget is used up.
+    uint64_t render_pixels( ThreadPool& pool, std::vector<Vec>& pixels, bool report_progress ) {
+        pixels.assign( camera.width * camera.height, Vec( 0, 0, 0 ) );
+        // Here I size the camera ray cones to the spacing of the base samples.
+        // Refined images end up with several samples per pixel, so their
+        // textures are filtered as for at least the default four.
+        int cone_samples = time_budget > 0.0 ? std::max( min_samples, 4 ) : std::max( min_samples, 1 );
+        primary_spread = camera.pixel_spread() / std::sqrt( (float)cone_samples );
+
+        int tiles_x = ( camera.width + tile_size - 1 ) / tile_size;
+        int tiles_y = ( camera.height + tile_size - 1 ) / tile_size;
+        int tile_count = tiles_x * tiles_y;
+        // Refinement goes back to tiles, so with a time budget their samples
+        // are kept for the whole render
+        std::vector<TileSamples> tiles( time_budget > 0.0 ? tile_count : 0 );
+
+        std::atomic<int> tiles_done( 0 );
+        std::atomic<uint64_t> rays_traced( 0 );
+        std::atomic<uint64_t> samples_taken( 0 );
+        int next_report = 10;
+        std::mutex report_mutex;
+        auto start = std::chrono::steady_clock::now();
+
+        // Textures are decoded as tiles first sample them, and only dropped
+        // to meet the budget once no render uses the cache
+        texture_cache->begin_render();
+        pool.parallel_for( tile_count, [&]( int tile ) {
+            uint64_t rays_before = ray_count();
+            TileSamples local;
+            TileSamples& samples = tiles.empty() ? local : tiles[tile];
+            start_tile( ( tile % tiles_x ) * tile_size, ( tile / tiles_x ) * tile_size, samples );
+            if ( time_budget > 0.0 ) {
+                // The first pass only gets the base samples, everywhere
+                samples_taken += sample_pixels( samples, all_pixels( samples ) );
+            } else {
+                std::vector<int> active = all_pixels( samples );
+                while ( !active.empty() ) {
+                    samples_taken += sample_pixels( samples, active );
+                    active = uncertain_pixels( samples, sample_threshold );
+                }
+            }
+            write_tile( samples, pixels );
+            rays_traced += ray_count() - rays_before;
+            if ( !report_progress ) {
+                return;
+            }
+
+            // Progress output every 10% of tiles. Workers finish out of order,
+            // so the counter and the report threshold are shared.
+            int done = ++tiles_done;
+            std::lock_guard<std::mutex> lock( report_mutex );
+            while ( next_report <= 100 && ( done * 100 ) / tile_count >= next_report ) {
+                std::cout << "Progress: " << next_report << "% (" << done << "/" << tile_count << " tiles)" << std::endl;
+                next_report += 10;
+            }
+        } );
+        last_render_passes = 1;
+        if ( time_budget > 0.0 ) {
+            auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                        std::chrono::duration<double>( time_budget ) );
+            refine( pool, tiles, deadline, pixels, rays_traced, samples_taken );
+            if ( report_progress ) {
+                std::cout << "Refined in " << last_render_passes - 1 << " passes" << std::endl;
+            }
         }
+        texture_cache->end_render();
 
-        Hit hit;
-        if ( !intersect( ray, hit ) ) {
-            return background_color;
+        last_render_seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+        last_samples_per_pixel = (double)samples_taken / std::max( 1, camera.width * camera.height );
+        return rays_traced;
+    }
+
+    // Refines the image in passes until the deadline. Each pass doubles the
+    // samples of the tiles where that removes the most error per sample,
+    // until it has about a quarter sample per pixel of work. Whole tiles are
+    // refined, since a pixel whose few samples happened to agree may still
+    // be on an edge its neighbours show. A pass only counts if it completes
+    // before the deadline; one that doesn't is thrown away, so the image only
+    // depends on the number of completed passes, which is left in
+    // last_render_passes. Tiles in flight at the deadline still finish, so a
+    // render overruns its budget by at most one tile's refinement.
+    void refine( ThreadPool& pool, std::vector<TileSamples>& tiles, std::chrono::steady_clock::time_point deadline,
+                 std::vector<Vec>& pixels, std::atomic<uint64_t>& rays_traced, std::atomic<uint64_t>& samples_taken ) {
+        uint64_t pass_size = std::max( 1, camera.width * camera.height / 4 );
+        while ( std::chrono::steady_clock::now() < deadline ) {
+            // Doubling a pixel's n samples halves its squared error e, so
+            // the gain per sample is e / 2n
+            std::vector<std::pair<float, int>> ranked;
+            std::vector<uint64_t> costs( tiles.size(), 0 );
+            for ( int tile = 0; tile < (int)tiles.size(); tile++ ) {
+                float error = 0.0f;
+                for ( int pixel : open_pixels( tiles[tile] ) ) {
+                    error += pixel_error( tiles[tile], pixel );
+                    costs[tile] += std::min( tiles[tile].taken[pixel], sample_limit() - tiles[tile].taken[pixel] );
+                }
+                if ( costs[tile] > 0 ) {
+                    ranked.push_back( { -error / costs[tile], tile } );
+                }
+            }
+            if ( ranked.empty() ) {
+                return;
+            }
+            std::sort( ranked.begin(), ranked.end() );
+            size_t count = 0;
+            for ( uint64_t planned = 0; count < ranked.size() && planned < pass_size; count++ ) {
+                planned += costs[ranked[count].second];
+            }
+
+            // Here I sample into copies and keep them only if the pass completes
+            std::vector<TileSamples> refined( count );
+            std::atomic<bool> late( false );
+            std::atomic<uint64_t> pass_rays( 0 );
+            std::atomic<uint64_t> pass_samples( 0 );
+            pool.parallel_for( (int)count, [&]( int i ) {
+                if ( late || std::chrono::steady_clock::now() >= deadline ) {
+                    late = true;
+                    return;
+                }
+                uint64_t rays_before = ray_count();
+                refined[i] = tiles[ranked[i].second];
+                pass_samples += sample_pixels( refined[i], open_pixels( refined[i] ) );
+                pass_rays += ray_count() - rays_before;
+            } );
+            // The rays were traced either way. Tiles started just before the
+            // deadline may have finished after it, which makes the pass late
+            // too.
+            rays_traced += pass_rays;
+            if ( late || std::chrono::steady_clock::now() > deadline ) {
+                return;
+            }
+            for ( size_t i = 0; i < count; i++ ) {
+                tiles[ranked[i].second] = std::move( refined[i] );
+                write_tile( tiles[ranked[i].second], pixels );
+            }
+            samples_taken += pass_samples;
+            last_render_passes++;
+        }
+    }
+
+    void start_tile( int x0, int y0, TileSamples& samples ) const {
+        samples.x0 = x0;
+        samples.y0 = y0;
+        samples.x1 = std::min( x0 + tile_size, camera.width );
+        samples.y1 = std::min( y0 + tile_size, camera.height );
+        int pixel_count = ( samples.x1 - x0 ) * ( samples.y1 - y0 );
+        samples.sums.assign( pixel_count, Vec( 0, 0, 0 ) );
+        samples.lum_sums.assign( pixel_count, 0.0f );
+        samples.lum_squares.assign( pixel_count, 0.0f );
+        samples.taken.assign( pixel_count, 0 );
+    }
+
+    static std::vector<int> all_pixels( const TileSamples& samples ) {
+        std::vector<int> pixels( samples.taken.size() );
+        for ( size_t i = 0; i < pixels.size(); i++ ) {
+            pixels[i] = (int)i;
+        }
+        return pixels;
+    }
+
+    // Most samples a pixel takes: max_samples, or with a time budget as many
+    // as there is time for unless max_samples asks for more than the base
+    int sample_limit() const {
+        int base = std::max( min_samples, 1 );
+        if ( time_budget > 0.0 && max_samples <= base ) {
+            return 1 << 20;
+        }
+        return std::max( max_samples, base );
+    }
+
+    // Gives each listed pixel of the tile min_samples samples if it has none
+    // yet, else doubles its samples, up to sample_limit(). Returns the number
+    // of samples taken.
+    uint64_t sample_pixels( TileSamples& samples, const std::vector<int>& active ) {
+        int tile_w = samples.x1 - samples.x0;
+        int base = std::max( min_samples, 1 );
+        int most = sample_limit();
+        std::vector<Ray> rays;
+        std::vector<uint32_t> seeds;
+        std::vector<int> owners;
+        for ( int pixel : active ) {
+            int x = samples.x0 + pixel % tile_w;
+            int y = samples.y0 + pixel / tile_w;
+            int taken = samples.taken[pixel];
+            int count = std::min( taken > 0 ? taken : base, most - taken );
+            for ( int k = taken; k < taken + count; k++ ) {
+                rays.push_back( primary_ray( x, y, k ) );
+                // Per-sample seeds for the random decisions along each path
+                seeds.push_back( sampler.sample_seed( x, y, k ) );
+                owners.push_back( pixel );
+            }
         }
+        std::vector<Vec> colors;
+        trace_samples( samples.x0, samples.y0, samples.x1, samples.y1, rays, seeds, colors );
 
-        Vec color = Vec( 0, 0, 0 );
-        Vec original_normal = hit.normal.normalize();  // Keep the original normal for refraction
-        Vec normal = original_normal;
+        for ( size_t i = 0; i < rays.size(); i++ ) {
+            int pixel = owners[i];
+            samples.sums[pixel] = samples.sums[pixel] + colors[i];
+            float lum = luminance( colors[i] );
+            samples.lum_sums[pixel] += lum;
+            samples.lum_squares[pixel] += lum * lum;
+            samples.taken[pixel]++;
+        }
+        return rays.size();
+    }
+
+    // Squared standard error of a pixel's mean luminance. With a single
+    // sample there is no estimate, so the largest possible one is assumed.
+    static float pixel_error( const TileSamples& samples, int pixel ) {
+        int n = samples.taken[pixel];
+        if ( n < 2 ) {
+            return 0.25f;
+        }
+        float mean = samples.lum_sums[pixel] / n;
+        float variance = std::max( 0.0f, samples.lum_squares[pixel] / n - mean * mean ) * n / ( n - 1 );
+        return variance / n;
+    }
+
+    // Pixels below sample_limit() whose standard error is above threshold
+    std::vector<int> uncertain_pixels( const TileSamples& samples, float threshold ) const {
+        std::vector<int> pixels;
+        int most = sample_limit();
+        for ( int pixel = 0; pixel < (int)samples.taken.size(); pixel++ ) {
+            if ( samples.taken[pixel] < most && pixel_error( samples, pixel ) > threshold * threshold ) {
+                pixels.push_back( pixel );
+            }
+        }
+        return pixels;
+    }
+
+    // Pixels below sample_limit()
+    std::vector<int> open_pixels( const TileSamples& samples ) const {
+        std::vector<int> pixels;
+        int most = sample_limit();
+        for ( int pixel = 0; pixel < (int)samples.taken.size(); pixel++ ) {
+            if ( samples.taken[pixel] < most ) {
+                pixels.push_back( pixel );
+            }
+        }
+        return pixels;
+    }
+
+    void write_tile( const TileSamples& samples, std::vector<Vec>& pixels ) const {
+        int tile_w = samples.x1 - samples.x0;
+        for ( int pixel = 0; pixel < (int)samples.taken.size(); pixel++ ) {
+            // Here I handle the coordinate system
+            int x = samples.x0 + pixel % tile_w;
+            int flipped_y = camera.height - 1 - ( samples.y0 + pixel / tile_w );
+            pixels[flipped_y * camera.width + x] = samples.sums[pixel] * ( 1.0f / samples.taken[pixel] );
+        }
+    }
+
+    // Luminance of a colour as the image shows it, clamped to [0, 1]
+    static float luminance( const Vec& color ) {
+        return 0.2126f * std::min( std::max( color.x, 0.0f ), 1.0f ) +
+               0.7152f * std::min( std::max( color.y, 0.0f ), 1.0f ) +
+               0.0722f * std::min( std::max( color.z, 0.0f ), 1.0f );
+    }
+
+    // Colours of camera rays that all start in the pixel block [x0, x1) x
+    // [y0, y1), with the seeds for their random decisions
+    void trace_samples( int x0, int y0, int x1, int y1, const std::vector<Ray>& rays,
+                        const std::vector<uint32_t>& seeds, std::vector<Vec>& colors ) {
+        size_t count = rays.size();
+        colors.resize( count );
+        if ( packet_tracing && max_bounces >= 0 ) {
+            std::vector<Hit> hits( count );
+            std::vector<char> found( count );
+            intersect_packet( x0, y0, x1, y1, rays, hits, found );
+
+            // From the first hit on the rays go their own ways
+            for ( size_t i = 0; i < count; i++ ) {
+                colors[i] = found[i] ? trace_path( rays[i], &hits[i], seeds[i] ) : background_color;
+            }
+        } else {
+            for ( size_t i = 0; i < count; i++ ) {
+                colors[i] = trace_path( rays[i], nullptr, seeds[i] );
+            }
+        }
+    }
+
+    // Closest hits for all primary rays of the pixel block [x0, x1) x [y0, y1).
+    // The top-level BVH is walked once for the whole block: nodes outside the
+    // block's frustum, or behind every ray's current closest hit, are skipped
+    // for all rays together. Hits are exactly the ones intersect() would find.
+    void intersect_packet( int x0, int y0, int x1, int y1, const std::vector<Ray>& rays,
+                           std::vector<Hit>& hits, std::vector<char>& found ) {
+        Vec corners[4] = {
+            camera.get_ray( (float)x0, (float)y0 ).direction,
+            camera.get_ray( (float)x1, (float)y0 ).direction,
+            camera.get_ray( (float)x1, (float)y1 ).direction,
+            camera.get_ray( (float)x0, (float)y1 ).direction
+        };
+        Vec center = camera.get_ray( 0.5f * ( x0 + x1 ), 0.5f * ( y0 + y1 ) ).direction;
+        Frustum frustum( camera.position, corners, center );
+
+        size_t count = rays.size();
+        ray_count() += count;
+        std::vector<Vec> inv_dirs( count );
+        std::vector<float> closest_t( count, INFINITY );
+        std::vector<uint32_t> closest_index( count, 0 );
+        for ( size_t i = 0; i < count; i++ ) {
+            const Vec& d = rays[i].direction;
+            inv_dirs[i] = Vec( 1.0f / d.x, 1.0f / d.y, 1.0f / d.z );
+            found[i] = 0;
+        }
+
+        bvh.traverse_frustum( frustum, rays[0].max_t, [&]( const BVHNode& leaf, float& max_distance ) {
+            for ( size_t i = 0; i < count; i++ ) {
+                const Ray& ray = rays[i];
+                float t_max = std::min( closest_t[i], ray.max_t );
+                float t_entry;
+                if ( !leaf.bounds.intersect( ray.origin, inv_dirs[i], ray.min_t, t_max, t_entry ) ) {
+                    continue;
+                }
+
+                for ( uint32_t k = leaf.left_first; k < leaf.left_first + leaf.count; k++ ) {
+                    uint32_t index = bvh.prim_indices[k];
+                    Hit temp_hit;
+                    temp_hit.t = INFINITY;
+
+                    if ( objects[index]->intersect( ray, temp_hit ) ) {
+                        if ( temp_hit.t >= ray.min_t && temp_hit.t <= ray.max_t &&
+                             ( temp_hit.t < closest_t[i] || ( temp_hit.t == closest_t[i] && index < closest_index[i] ) ) ) {
+                            closest_t[i] = temp_hit.t;
+                            closest_index[i] = index;
+                            hits[i] = temp_hit;
+                            found[i] = 1;
+                        }
+                    }
+                }
+            }
+
+            // Primary rays are unit length and start at the apex, so t is
+            // the distance from the camera
+            max_distance = 0.0f;
+            for ( size_t i = 0; i < count; i++ ) {
+                max_distance = std::max( max_distance, std::min( closest_t[i], rays[i].max_t ) );
+            }
+        } );
+    }
+
+    // How wide a ray is: width across at its origin, growing by spread per
+    // unit of distance. Camera rays start as wide as a sample; curved
+    // mirrors and lenses make the cones of their rays spread faster.
+    struct RayCone {
+        float width;
+        float spread;
+
+        float width_at( float t ) const {
+            return width + spread * t;
+        }
+    };
+
+    // A ray still to be traced together with the weight its color enters the
+    // pixel with (the product of the reflection/transmission factors so far)
+    // and its cone
+    struct RayTask {
+        Ray ray;
+        int depth;
+        float weight;
+        RayCone cone;
+    };
+
+    // Traces a camera ray and everything it spawns. Instead of recursing into
+    // reflection and transmission, child rays go on an explicit per-thread
+    // stack with their accumulated weight, and branches whose weight drops
+    // below min_ray_weight are dropped (or, with russian_roulette, kept with a
+    // probability proportional to their weight and boosted to compensate).
+    // first_hit, if given, is the already known hit of the camera ray; seed
+    // makes the roulette decisions reproducible per sample.
+    Vec trace_path( const Ray& camera_ray, const Hit* first_hit, uint32_t seed ) {
+        std::vector<RayTask>& stack = ray_stack();
+        stack.clear();
+        stack.push_back( { camera_ray, 0, 1.0f, { 0.0f, primary_spread } } );
+
+        Vec color( 0, 0, 0 );
+        uint32_t decisions = 0;
+        bool first = true;
+
+        while ( !stack.empty() ) {
+            RayTask task = stack.back();
+            stack.pop_back();
+
+            if ( task.depth > max_bounces ) {
+                color = color + background_color * task.weight;
+                first = false;
+                continue;
+            }
+
+            Hit hit;
+            if ( first && first_hit ) {
+                hit = *first_hit;
+            } else if ( !intersect( task.ray, hit ) ) {
+                color = color + background_color * task.weight;
+                first = false;
+                continue;
+            }
+            first = false;
+
+            const Ray& ray = task.ray;
+            // Here I measure the cone where it meets the surface: stretched
+            // by the angle it comes in at, in texture coordinates
+            float cone_width = task.cone.width_at( hit.t );
+            float cos_in = std::abs( Vec::dot( hit.normal.normalize(), ray.direction ) );
+            float footprint = cone_width / std::max( cos_in, 0.01f ) * std::sqrt( hit.uv_density );
+            Vec local_color = local_lighting( ray, hit, footprint );
+
+            // Calculate total surface contribution factor
+            float surface_factor = 1.0f;
+            if ( hit.material ) {
+                surface_factor = 1.0f - hit.material->transmission - hit.material->reflection;
+                surface_factor = std::max( 0.0f, surface_factor );
+            }
+
+            // Start with local lighting (reduced by transparency and reflection)
+            color = color + local_color * surface_factor * task.weight;
+
+            if ( !hit.material ) {
+                continue;
+            }
+            Vec original_normal = hit.normal.normalize();  // Keep the original normal for refraction
+            Vec point = hit.point;
+
+            // Across the cone the normal turns by cone_width * curvature, and
+            // a convex mirror spreads the reflected rays by twice that angle.
+            // Seen from inside the surface is concave and focuses them, as
+            // does refraction through a ball, and there the cone just goes on.
+            RayCone straight_cone = { cone_width, task.cone.spread };
+            RayCone reflect_cone = straight_cone;
+            if ( Vec::dot( ray.direction, original_normal ) < 0 ) {
+                reflect_cone.spread += 2.0f * cone_width * hit.curvature;
+            }
+
+            // Reflection
+            if ( hit.material->reflection > 0 ) {
+                Vec reflect_dir = Vec::reflect( ray.direction, original_normal );
+                Ray reflect_ray( point + original_normal * 0.001f, reflect_dir );
+                reflect_ray.min_t = 0.001f;
+                reflect_ray.max_t = 1000.0f;
+                push_ray( reflect_ray, task.depth + 1, task.weight * hit.material->reflection, reflect_cone, seed, decisions );
+            }
+
+            // Transmission
+            if ( hit.material->transmission > 0 ) {
+                // Here I get the original normal for refraction (not the flipped one)
+                Vec refraction_normal = original_normal;
+
+                // Here I calculate the refracted ray
+                Vec refract_dir = hit.material->refract( ray.direction, refraction_normal, hit.material->ior );
+
+                if ( refract_dir != Vec( 0, 0, 0 ) ) {
+                    // Here I determine the ray offset direction
+                    bool entering = Vec::dot( ray.direction, refraction_normal ) < 0;
+                    Vec offset_normal = entering ? -refraction_normal : refraction_normal;
+
+                    Ray refract_ray( point + offset_normal * 0.001f, refract_dir );
+                    refract_ray.min_t = 0.001f;
+                    refract_ray.max_t = 1000.0f;
+                    push_ray( refract_ray, task.depth + 1, task.weight * hit.material->transmission, straight_cone, seed, decisions );
+                } else {
+                    // Total internal reflection - use reflection instead of transmission
+                    Vec reflect_dir = Vec::reflect( ray.direction, refraction_normal );
+                    Ray reflect_ray( point + refraction_normal * 0.001f, reflect_dir );
+                    reflect_ray.min_t = 0.001f;
+                    reflect_ray.max_t = 1000.0f;
+                    push_ray( reflect_ray, task.depth + 1, task.weight * hit.material->transmission, straight_cone, seed, decisions );
+                }
+            }
+        }
+
+        return color;
+    }
+
+    void push_ray( const Ray& ray, int depth, float weight, const RayCone& cone, uint32_t seed, uint32_t& decisions ) {
+        if ( weight < min_ray_weight ) {
+            if ( !russian_roulette ) {
+                return;
+            }
+            // Survive with probability weight / min_ray_weight and carry
+            // min_ray_weight on, so the expected contribution is unchanged
+            float survive = weight / min_ray_weight;
+            if ( hash_to_float( hash_combine( seed, decisions++ ) ) >= survive ) {
+                return;
+            }
+            weight = min_ray_weight;
+        }
+        ray_stack().push_back( { ray, depth, weight, cone } );
+    }
+
+    // World-space bounds of all objects, as the top-level BVH stores them
+    std::vector<AABB> object_bounds() const {
+        std::vector<AABB> bounds( objects.size() );
+        for ( size_t i = 0; i < objects.size(); i++ ) {
+            bounds[i] = objects[i]->get_bounds();
+            // Here I pad the box a little so rounding in the objects' own
+            // intersection code can never land a hit just outside of it
+            Vec pad = bounds[i].extent() * 1e-4f + Vec( 1e-5f, 1e-5f, 1e-5f );
+            bounds[i] = AABB( bounds[i].min - pad, bounds[i].max + pad );
+        }
+        return bounds;
+    }
+
+    // Rays traced by the calling thread, for the throughput report
+    static uint64_t& ray_count() {
+        static thread_local uint64_t count = 0;
+        return count;
+    }
+
+    static std::vector<RayTask>& ray_stack() {
+        static thread_local std::vector<RayTask> stack;
+        return stack;
+    }
+
+    // Ambient plus direct lighting (diffuse and specular, with shadows) at a
+    // hit. footprint is the width of the ray there in texture coordinates.
+    Vec local_lighting( const Ray& ray, const Hit& hit, float footprint ) {
+        // Calculate local lighting (ambient + direct lighting)
+        Vec local_color = Vec( 0, 0, 0 );
+        if ( !hit.material ) {
+            return local_color;
+        }
+        const Material& material = *hit.material;
+
+        Vec normal = hit.normal.normalize();
         Vec point = hit.point;
         Vec view_dir = -ray.direction.normalize();
 
@@ -128,130 +793,105 @@ private:
             normal = -normal;
         }
 
-        // Calculate local lighting (ambient + direct lighting)
-        Vec local_color = Vec( 0, 0, 0 );
-        
+        // Here I get the surface color once for all lights
+        Vec surface_color = material.get_color( hit.u, hit.v, footprint );
+
         // Start with ambient light
-        for ( Light* light : lights ) {
-            if ( dynamic_cast<AmbientLight*>( light ) ) {
-                Vec light_intensity = light->get_intensity( point );
-                // Here I get the surface color
-                if ( hit.material ) {
-                    Vec surface_color = hit.material->get_color(hit.u, hit.v);
-                    Vec ambient_contribution = surface_color * hit.material->ka * light_intensity;
-                    local_color = local_color + ambient_contribution;
-                }
-            }
-        }
+        local_color = local_color + surface_color * material.ka * light_set.ambient;
 
-        // Calculate lighting for non-ambient lights
-        for ( Light* light : lights ) {
-            if ( dynamic_cast<AmbientLight*>( light ) ) {
-                continue;
+        auto add_light = [&]( const Vec& light_dir, float light_dist, const Vec& light_intensity ) {
+            // Lights that don't reach the point need no shadow ray
+            if ( light_intensity == Vec( 0, 0, 0 ) ) {
+                return;
             }
-            
-            Vec light_dir = light->get_direction( point );
-            float light_dist = light->get_distance( point );
-            Vec light_intensity = light->get_intensity( point );
 
             // Here I check for shadows
             Ray shadow_ray( point + normal * 0.001f, light_dir );
             shadow_ray.min_t = 0.001f;
             // For parallel lights, use very large distance; for point lights, use actual distance
             shadow_ray.max_t = std::isinf(light_dist) ? 1000.0f : light_dist - 0.001f;
-            Hit shadow_hit;
-            shadow_hit.t = INFINITY;
-            
-            bool in_shadow = false;
-            if ( intersect( shadow_ray, shadow_hit ) ) {
-                in_shadow = true; // Any intersection within ray bounds means shadow
-            }
-            
-            if ( !in_shadow && hit.material ) {
-                // Get surface color from texture
-                Vec surface_color = hit.material->get_color(hit.u, hit.v);
-                
-                // Diffuse lighting
-                float diffuse_factor = std::max( 0.0f, Vec::dot( normal, light_dir ) );
-                Vec diffuse_color = surface_color * hit.material->kd * diffuse_factor * light_intensity;
-                local_color = local_color + diffuse_color;
-
-                // Here I add the shiny highlights
-                Vec half_vector = ( light_dir + view_dir ).normalize();
-                float specular_factor = std::pow( std::max( 0.0f, Vec::dot( normal, half_vector ) ), hit.material->shininess );
-                Vec specular_color = light_intensity * hit.material->ks * specular_factor;
-                local_color = local_color + specular_color;
+            // Any intersection within ray bounds means shadow
+            if ( occluded( shadow_ray ) ) {
+                return;
             }
-        }
 
-        // Calculate total surface contribution factor
-        float surface_factor = 1.0f;
-        if ( hit.material ) {
-            surface_factor = 1.0f - hit.material->transmission - hit.material->reflection;
-            surface_factor = std::max( 0.0f, surface_factor );
+            // Diffuse lighting
+            float diffuse_factor = std::max( 0.0f, Vec::dot( normal, light_dir ) );
+            Vec diffuse_color = surface_color * material.kd * diffuse_factor * light_intensity;
+            local_color = local_color + diffuse_color;
+
+            // Here I add the shiny highlights
+            Vec half_vector = ( light_dir + view_dir ).normalize();
+            float specular_factor = std::pow( std::max( 0.0f, Vec::dot( normal, half_vector ) ), material.shininess );
+            Vec specular_color = light_intensity * material.ks * specular_factor;
+            local_color = local_color + specular_color;
+        };
+
+        const LightSet::PointLights& points = light_set.point;
+        for ( size_t i = 0; i < points.x.size(); i++ ) {
+            Vec to_light = Vec( points.x[i], points.y[i], points.z[i] ) - point;
+            float dist = to_light.length();
+            // Here I calculate the light falloff
+            Vec intensity = Vec( points.r[i], points.g[i], points.b[i] ) / ( 1.0f + 0.09f * dist + 0.032f * dist * dist );
+            add_light( to_light.normalize(), dist, intensity );
         }
-        
-        // Start with local lighting (reduced by transparency and reflection)
-        color = local_color * surface_factor;
-
-        // Reflection
-        if ( hit.material && hit.material->reflection > 0 ) {
-            Vec reflect_dir = Vec::reflect( ray.direction, original_normal );
-            Ray reflect_ray( point + original_normal * 0.001f, reflect_dir );
-            reflect_ray.min_t = 0.001f;
-            reflect_ray.max_t = 1000.0f;
-            Vec reflected_color = trace_ray( reflect_ray, depth + 1 );
-            color = color + reflected_color * hit.material->reflection;
+
+        const LightSet::ParallelLights& parallels = light_set.parallel;
+        for ( size_t i = 0; i < parallels.dx.size(); i++ ) {
+            add_light( Vec( parallels.dx[i], parallels.dy[i], parallels.dz[i] ), INFINITY,
+                       Vec( parallels.r[i], parallels.g[i], parallels.b[i] ) );
         }
 
-        // Transmission
-        if ( hit.material && hit.material->transmission > 0 ) {
-            // Here I get the original normal for refraction (not the flipped one)
-            Vec refraction_normal = original_normal;
-            
-            // Here I calculate the refracted ray
-            Vec refract_dir = hit.material->refract( ray.direction, refraction_normal, hit.material->ior );
-            
-            if ( refract_dir != Vec( 0, 0, 0 ) ) {
-                // Here I determine the ray offset direction
-                bool entering = Vec::dot( ray.direction, refraction_normal ) < 0;
-                Vec offset_normal = entering ? -refraction_normal : refraction_normal;
-                
-                Ray refract_ray( point + offset_normal * 0.001f, refract_dir );
-                refract_ray.min_t = 0.001f;
-                refract_ray.max_t = 1000.0f;
-                Vec refracted_color = trace_ray( refract_ray, depth + 1 );
-                color = color + refracted_color * hit.material->transmission;
-            } else {
-                // Total internal reflection - use reflection instead of transmission
-                Vec reflect_dir = Vec::reflect( ray.direction, refraction_normal );
-                Ray reflect_ray( point + refraction_normal * 0.001f, reflect_dir );
-                reflect_ray.min_t = 0.001f;
-                reflect_ray.max_t = 1000.0f;
-                Vec reflected_color = trace_ray( reflect_ray, depth + 1 );
-                color = color + reflected_color * hit.material->transmission;
-            }
+        const LightSet::SpotLights& spots = light_set.spot;
+        for ( size_t i = 0; i < spots.x.size(); i++ ) {
+            Vec to_light = Vec( spots.x[i], spots.y[i], spots.z[i] ) - point;
+            float dist = to_light.length();
+            Vec dir = to_light.normalize();
+            add_light( dir, dist, light_set.spot_intensity( i, dir, dist ) );
         }
 
-        return color;
+        return local_color;
+    }
+
+    // Shadow ray query: stops at the first object found within the ray bounds
+    bool occluded( const Ray& ray ) {
+        ray_count()++;
+        return bvh.occluded( ray, [&]( uint32_t first, uint32_t count ) {
+            for ( uint32_t i = first; i < first + count; i++ ) {
+                if ( objects[bvh.prim_indices[i]]->occluded( ray ) ) {
+                    return true;
+                }
+            }
+            return false;
+        } );
     }
 
     bool intersect( const Ray& ray, Hit& hit ) {
+        ray_count()++;
         bool found = false;
         float closest_t = INFINITY;
+        uint32_t closest_index = 0;
 
-        for ( Object* obj : objects ) {
-            Hit temp_hit;
-            temp_hit.t = INFINITY;
-            
-            if ( obj->intersect( ray, temp_hit ) ) {
-                if ( temp_hit.t < closest_t && temp_hit.t >= ray.min_t && temp_hit.t <= ray.max_t ) {
-                    closest_t = temp_hit.t;
-                    hit = temp_hit;
-                    found = true;
+        bvh.intersect( ray, ray.max_t, [&]( uint32_t first, uint32_t count, float& t_max ) {
+            for ( uint32_t i = first; i < first + count; i++ ) {
+                uint32_t index = bvh.prim_indices[i];
+                Hit temp_hit;
+                temp_hit.t = INFINITY;
+
+                if ( objects[index]->intersect( ray, temp_hit ) ) {
+                    if ( temp_hit.t >= ray.min_t && temp_hit.t <= ray.max_t &&
+                         ( temp_hit.t < closest_t || ( temp_hit.t == closest_t && index < closest_index ) ) ) {
+                        // Equal distances go to the lower index, just like the old
+                        // linear loop over all objects did
+                        closest_t = temp_hit.t;
+                        closest_index = index;
+                        hit = temp_hit;
+                        found = true;
+                        t_max = std::min( t_max, closest_t );
+                    }
                 }
             }
-        }
+        } );
 
         return found;
     }
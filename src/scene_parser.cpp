@@ -10,13 +10,53 @@
 #include <string>
 #include <tinyxml2.h>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <set>
 
-bool SceneParser::parse( Scene& scene, const std::string& filename ) {
+bool SceneParser::parse( Scene& scene, const std::string& filename, ThreadPool* pool ) {
     tinyxml2::XMLDocument doc;
     if ( doc.LoadFile( filename.c_str() ) != tinyxml2::XML_SUCCESS ) {
         return false;
     }
+    return parse_document( scene, doc, pool );
+}
+
+bool SceneParser::parse_text( Scene& scene, const std::string& xml, ThreadPool* pool ) {
+    tinyxml2::XMLDocument doc;
+    if ( doc.Parse( xml.data(), xml.size() ) != tinyxml2::XML_SUCCESS ) {
+        return false;
+    }
+    return parse_document( scene, doc, pool );
+}
+
+void SceneParser::load_assets( Scene& scene, tinyxml2::XMLElement* root, ThreadPool& pool ) {
+    std::set<std::string> meshes;
+    tinyxml2::XMLElement* surfaces = root->FirstChildElement( "surfaces" );
+    for ( tinyxml2::XMLElement* mesh = surfaces ? surfaces->FirstChildElement( "mesh" ) : nullptr; 
+          mesh; 
+          mesh = mesh->NextSiblingElement( "mesh" ) ) {
+        if ( const char* name = mesh->Attribute( "name" ) ) {
+            meshes.insert( name );
+        }
+    }
+    if ( meshes.size() < 2 ) {
+        return;
+    }
 
+    auto start = std::chrono::steady_clock::now();
+    TaskGroup group( pool );
+    for ( const std::string& name : meshes ) {
+        group.run( [&scene, name] { scene.mesh_cache->get( name, scene.bvh_options ); } );
+    }
+    group.wait();
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    std::cout << "Loaded " << meshes.size() << " meshes in " << seconds << " s" << std::endl;
+}
+
+bool SceneParser::parse_document( Scene& scene, tinyxml2::XMLDocument& doc, ThreadPool* pool ) {
     tinyxml2::XMLElement* root = doc.RootElement();
     if ( !root || strcmp( root->Name(), "scene" ) != 0 ) {
         return false;
@@ -188,8 +228,33 @@ bool SceneParser::parse( Scene& scene, const std::string& filename ) {
         }
     }
 
+    // Parse the BVH builder and node format, except for the fields the
+    // command line chose
+    tinyxml2::XMLElement* bvh = root->FirstChildElement( "bvh" );
+    if ( bvh ) {
+        const char* builder = bvh->Attribute( "builder" );
+        if ( builder && !scene.bvh_builder_fixed && !BVHBuildOptions::parse_builder( builder, scene.bvh_options.builder ) ) {
+            std::cerr << "Warning: Unknown BVH builder " << builder << ", using " << scene.bvh_options.builder_name() << std::endl;
+        }
+        if ( !scene.bvh_treelets_fixed ) {
+            scene.bvh_options.treelet_passes = bvh->IntAttribute( "treelets", 0 );
+        }
+        const char* format = bvh->Attribute( "format" );
+        if ( format && !scene.bvh_layout_fixed && !BVHBuildOptions::parse_layout( format, scene.bvh_options.layout ) ) {
+            std::cerr << "Warning: Unknown BVH format " << format << ", using " << scene.bvh_options.layout_name() << std::endl;
+        }
+    }
+
+    // The BVH options are known now, so every asset can be loaded at once;
+    // the surfaces below then find them in the caches
+    if ( pool ) {
+        load_assets( scene, root, *pool );
+    }
+
     // Parse surfaces
     tinyxml2::XMLElement* surfaces = root->FirstChildElement( "surfaces" );
+    // Surfaces with an id attribute, for animation keys to refer to
+    std::map<std::string, size_t> surface_ids;
     if ( surfaces ) {
         // Parse spheres
         for ( tinyxml2::XMLElement* sphere = surfaces->FirstChildElement( "sphere" ); 
@@ -209,7 +274,7 @@ bool SceneParser::parse( Scene& scene, const std::string& filename ) {
                     material = sphere->FirstChildElement( "material_textured" );
                 }
                 if ( material ) {
-                    Material* mat = parse_material( material );
+                    Material* mat = parse_material( material, scene.texture_cache );
                     if ( mat ) {
                         s->material = mat;
                         scene.materials.push_back( mat );
@@ -222,6 +287,9 @@ bool SceneParser::parse( Scene& scene, const std::string& filename ) {
                     s->transform = parse_transforms( transforms );
                 }
 
+                if ( const char* id = sphere->Attribute( "id" ) ) {
+                    surface_ids[id] = scene.objects.size();
+                }
                 scene.objects.push_back( s );
             }
         }
@@ -232,15 +300,17 @@ bool SceneParser::parse( Scene& scene, const std::string& filename ) {
               mesh = mesh->NextSiblingElement( "mesh" ) ) {
             const char* name = mesh->Attribute( "name" );
             if ( name ) {
-                Mesh* m = new Mesh();
-                if ( m->load( name ) ) {
+                // Here I share the geometry between all meshes using the same file
+                const MeshGeometry* geometry = scene.mesh_cache->get( name, scene.bvh_options );
+                if ( geometry ) {
+                    Mesh* m = new Mesh( geometry );
                     // Parse material
                     tinyxml2::XMLElement* material = mesh->FirstChildElement( "material_solid" );
                     if ( !material ) {
                         material = mesh->FirstChildElement( "material_textured" );
                     }
                     if ( material ) {
-                        Material* mat = parse_material( material );
+                        Material* mat = parse_material( material, scene.texture_cache );
                         if ( mat ) {
                             m->material = mat;
                             scene.materials.push_back( mat );
@@ -253,9 +323,10 @@ bool SceneParser::parse( Scene& scene, const std::string& filename ) {
                         m->transform = parse_transforms( transforms );
                     }
 
+                    if ( const char* id = mesh->Attribute( "id" ) ) {
+                        surface_ids[id] = scene.objects.size();
+                    }
                     scene.objects.push_back( m );
-                } else {
-                    delete m;
                 }
             }
         }
@@ -279,7 +350,7 @@ bool SceneParser::parse( Scene& scene, const std::string& filename ) {
                     tinyxml2::XMLElement* material = root->FirstChildElement( "material" );
                     while ( material ) {
                         if ( strcmp( material->Attribute( "id" ), material_id ) == 0 ) {
-                            Material* mat = parse_material( material );
+                            Material* mat = parse_material( material, scene.texture_cache );
                             if ( mat ) {
                                 s->material = mat;
                                 scene.materials.push_back( mat );
@@ -295,10 +366,15 @@ bool SceneParser::parse( Scene& scene, const std::string& filename ) {
         }
     }
 
+    tinyxml2::XMLElement* animation = root->FirstChildElement( "animation" );
+    if ( animation ) {
+        parse_animation( scene, animation, surface_ids );
+    }
+
     return true;
 }
 
-Material* SceneParser::parse_material( tinyxml2::XMLElement* material ) {
+Material* SceneParser::parse_material( tinyxml2::XMLElement* material, TextureCache* textures ) {
     // Check if this is a material_textured element
     tinyxml2::XMLElement* texture_elem = material->FirstChildElement( "texture" );
     if ( texture_elem ) {
@@ -340,7 +416,7 @@ Material* SceneParser::parse_material( tinyxml2::XMLElement* material ) {
                 ior = refraction->FloatAttribute( "iof", 1.0f );
             }
 
-            TexturedMaterial* mat = new TexturedMaterial( texture_name, ka, kd, ks, shininess, reflection, transmission, ior );
+            TexturedMaterial* mat = new TexturedMaterial( texture_name, ka, kd, ks, shininess, reflection, transmission, ior, textures );
             return mat;
         }
     }
@@ -406,7 +482,11 @@ Material* SceneParser::parse_material( tinyxml2::XMLElement* material ) {
 }
 
 Transform SceneParser::parse_transforms( tinyxml2::XMLElement* transforms ) {
-    Transform result;
+    return TransformOp::compose( parse_transform_ops( transforms ) );
+}
+
+std::vector<TransformOp> SceneParser::parse_transform_ops( tinyxml2::XMLElement* transforms ) {
+    std::vector<TransformOp> ops;
     for ( tinyxml2::XMLElement* transform = transforms->FirstChildElement(); 
           transform; 
           transform = transform->NextSiblingElement() ) {
@@ -415,22 +495,83 @@ Transform SceneParser::parse_transforms( tinyxml2::XMLElement* transforms ) {
             float x = transform->FloatAttribute( "x", 0.0f );
             float y = transform->FloatAttribute( "y", 0.0f );
             float z = transform->FloatAttribute( "z", 0.0f );
-            result = result * Transform::translate( Vec( x, y, z ) );
+            ops.push_back( { TransformOp::TRANSLATE, Vec( x, y, z ) } );
         } else if ( strcmp( type, "scale" ) == 0 ) {
             float x = transform->FloatAttribute( "x", 1.0f );
             float y = transform->FloatAttribute( "y", 1.0f );
             float z = transform->FloatAttribute( "z", 1.0f );
-            result = result * Transform::scale( Vec( x, y, z ) );
+            ops.push_back( { TransformOp::SCALE, Vec( x, y, z ) } );
         } else if ( strcmp( type, "rotateX" ) == 0 ) {
             float angle = transform->FloatAttribute( "theta", 0.0f );
-            result = result * Transform::rotateX( angle );
+            ops.push_back( { TransformOp::ROTATE_X, Vec( angle, 0, 0 ) } );
         } else if ( strcmp( type, "rotateY" ) == 0 ) {
             float angle = transform->FloatAttribute( "theta", 0.0f );
-            result = result * Transform::rotateY( angle );
+            ops.push_back( { TransformOp::ROTATE_Y, Vec( angle, 0, 0 ) } );
         } else if ( strcmp( type, "rotateZ" ) == 0 ) {
             float angle = transform->FloatAttribute( "theta", 0.0f );
-            result = result * Transform::rotateZ( angle );
+            ops.push_back( { TransformOp::ROTATE_Z, Vec( angle, 0, 0 ) } );
         }
     }
-    return result;
-} 
\ No newline at end of file
+    return ops;
+}
+
+void SceneParser::parse_animation( Scene& scene, tinyxml2::XMLElement* animation,
+                                   const std::map<std::string, size_t>& surface_ids ) {
+    Animation& result = scene.animation;
+    result.frame_count = std::max( 0, animation->IntAttribute( "frames", 0 ) );
+
+    auto read_vec = []( tinyxml2::XMLElement* parent, const char* name, Vec& value ) {
+        tinyxml2::XMLElement* element = parent->FirstChildElement( name );
+        if ( element ) {
+            value = Vec( element->FloatAttribute( "x", value.x ), element->FloatAttribute( "y", value.y ),
+                         element->FloatAttribute( "z", value.z ) );
+        }
+    };
+
+    // Here I fill in what a camera key leaves out from the scene's camera
+    for ( tinyxml2::XMLElement* key = animation->FirstChildElement( "camera_key" ); 
+          key; 
+          key = key->NextSiblingElement( "camera_key" ) ) {
+        CameraKey camera_key = { key->IntAttribute( "frame", 0 ), scene.camera.position, scene.camera.look_at,
+                                 scene.camera.up, scene.camera.fov };
+        read_vec( key, "position", camera_key.position );
+        read_vec( key, "lookat", camera_key.look_at );
+        read_vec( key, "up", camera_key.up );
+        tinyxml2::XMLElement* fov = key->FirstChildElement( "horizontal_fov" );
+        if ( fov ) {
+            camera_key.fov = fov->FloatAttribute( "angle", camera_key.fov );
+        }
+        result.camera_keys.push_back( camera_key );
+    }
+
+    for ( tinyxml2::XMLElement* key = animation->FirstChildElement( "surface_key" ); 
+          key; 
+          key = key->NextSiblingElement( "surface_key" ) ) {
+        const char* id = key->Attribute( "surface" );
+        auto surface = id ? surface_ids.find( id ) : surface_ids.end();
+        if ( surface == surface_ids.end() ) {
+            std::cerr << "Warning: Animation key for unknown surface " << ( id ? id : "(none)" ) << " ignored" << std::endl;
+            continue;
+        }
+        TransformKey transform_key;
+        transform_key.frame = key->IntAttribute( "frame", 0 );
+        tinyxml2::XMLElement* transforms = key->FirstChildElement( "transform" );
+        if ( transforms ) {
+            transform_key.ops = parse_transform_ops( transforms );
+        }
+
+        auto track = std::find_if( result.object_tracks.begin(), result.object_tracks.end(),
+                                   [&]( const ObjectTrack& t ) { return t.object == surface->second; } );
+        if ( track == result.object_tracks.end() ) {
+            result.object_tracks.push_back( { surface->second, {} } );
+            track = result.object_tracks.end() - 1;
+        }
+        track->keys.push_back( transform_key );
+    }
+
+    auto by_frame = []( const auto& a, const auto& b ) { return a.frame < b.frame; };
+    std::stable_sort( result.camera_keys.begin(), result.camera_keys.end(), by_frame );
+    for ( ObjectTrack& track : result.object_tracks ) {
+        std::stable_sort( track.keys.begin(), track.keys.end(), by_frame );
+    }
+}
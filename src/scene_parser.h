@@ -7,14 +7,29 @@
 #include "material.h"
 #include "light.h"
 #include "camera.h"
+#include "thread_pool.h"
+#include <map>
 #include <string>
+#include <vector>
 #include <tinyxml2.h>
 
 class SceneParser {
 public:
-    static bool parse( Scene& scene, const std::string& filename );
-    static Material* parse_material( tinyxml2::XMLElement* material );
+    // With a pool, all meshes of the scene are loaded on it concurrently
+    // before the surfaces are set up. Textures are decoded when first sampled.
+    static bool parse( Scene& scene, const std::string& filename, ThreadPool* pool = nullptr );
+    // Same as parse(), for a scene file that is already in memory. Asset
+    // paths are still relative to the scenes directory.
+    static bool parse_text( Scene& scene, const std::string& xml, ThreadPool* pool = nullptr );
+    static bool parse_document( Scene& scene, tinyxml2::XMLDocument& doc, ThreadPool* pool = nullptr );
+    // Loads every mesh the document names into the scene's cache, all at the
+    // same time, and waits for them
+    static void load_assets( Scene& scene, tinyxml2::XMLElement* root, ThreadPool& pool );
+    static Material* parse_material( tinyxml2::XMLElement* material, TextureCache* textures = nullptr );
     static Transform parse_transforms( tinyxml2::XMLElement* transforms );
+    static std::vector<TransformOp> parse_transform_ops( tinyxml2::XMLElement* transforms );
+    static void parse_animation( Scene& scene, tinyxml2::XMLElement* animation,
+                                 const std::map<std::string, size_t>& surface_ids );
 };
 
 #endif 
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "vec.h"
 #include "material.h"
 #include "transform.h"
+#include <algorithm>
 #include <cmath>
 
 #define M_PI 3.14159265358979323846
@@ -63,15 +64,55 @@ public:
         hit.u = ( phi + M_PI ) / ( 2.0f * M_PI );
         hit.v = ( theta + M_PI / 2.0f ) / M_PI;
 
+        // Here I work out how densely the uv mapping covers the surface:
+        // du = dphi / 2pi and dv = dtheta / pi on an area of r^2 cos(theta)
+        // dphi dtheta, which gets denser towards the poles
+        float area_scale = transform.area_scale( local_normal );
+        float cos_theta = std::max( std::sqrt( std::max( 0.0f, 1.0f - local_normal.y * local_normal.y ) ), 1e-3f );
+        hit.uv_density = 1.0f / ( 2.0f * M_PI * M_PI * radius * radius * cos_theta * area_scale );
+        hit.curvature = 1.0f / ( radius * std::sqrt( area_scale ) );
+
         return true;
     }
 
+    bool occluded( const Ray& ray ) const override {
+        Ray local_ray = transform.inverse_transform_ray( ray );
+
+        // Same roots as intersect(), without the normal and UV work
+        Vec oc = local_ray.origin - center;
+        float a = Vec::dot( local_ray.direction, local_ray.direction );
+        float b = 2.0f * Vec::dot( oc, local_ray.direction );
+        float c = Vec::dot( oc, oc ) - radius * radius;
+
+        float discriminant = b * b - 4.0f * a * c;
+        if ( discriminant < 0 ) {
+            return false;
+        }
+
+        float local_t = ( -b - std::sqrt( discriminant ) ) / ( 2.0f * a );
+        if ( local_t < ray.min_t || local_t > ray.max_t ) {
+            local_t = ( -b + std::sqrt( discriminant ) ) / ( 2.0f * a );
+            if ( local_t < ray.min_t || local_t > ray.max_t ) {
+                return false;
+            }
+        }
+
+        Vec world_point = transform.transform_point( local_ray.origin + local_ray.direction * local_t );
+        float world_t = Vec::dot( world_point - ray.origin, ray.direction.normalize() );
+        return world_t >= ray.min_t && world_t <= ray.max_t;
+    }
+
     Vec get_normal( const Vec& point ) const override {
         Vec local_point = transform.inverse_transform_point( point );
         Vec local_normal = ( local_point - center ).normalize();
         return transform.transform_normal( local_normal );
     }
 
+    AABB get_bounds() const override {
+        Vec r( radius, radius, radius );
+        return transform.transform_bounds( AABB( center - r, center + r ) );
+    }
+
     Vec2 get_uv( const Vec& point ) const {
         Vec local_point = transform.inverse_transform_point( point );
         Vec local_center = transform.inverse_transform_point( center );
@@ -0,0 +1,438 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "vec.h"
+#include "third_party/stb_image.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// sRGB encoded value in [0, 1] to linear
+inline float srgb_to_linear( float srgb ) {
+    if ( srgb <= 0.04045f ) {
+        return srgb / 12.92f;
+    }
+    return std::pow( ( srgb + 0.055f ) / 1.055f, 2.4f );
+}
+
+inline Vec srgb_to_linear( const Vec& srgb ) {
+    return Vec( srgb_to_linear( srgb.x ), srgb_to_linear( srgb.y ), srgb_to_linear( srgb.z ) );
+}
+
+// Decoded image with a mip chain. Texels stay 8-bit sRGB, a third of the
+// memory of floats, and are decoded through a 256 entry table instead of
+// calling pow per lookup. Every level is stored in 8x8 texel tiles, so the
+// texels around a lookup share a few cache lines rather than being spread
+// over as many rows as the footprint is high.
+struct TextureImage {
+    static const int tile_size = 8;
+
+    struct Level {
+        int width = 0;
+        int height = 0;
+        int tiles_x = 0;
+        // RGB texels, tile by tile, each tile row by row
+        std::vector<unsigned char> texels;
+
+        size_t offset( int x, int y ) const {
+            size_t tile = (size_t)( y / tile_size ) * tiles_x + x / tile_size;
+            return ( tile * tile_size * tile_size + ( y % tile_size ) * tile_size + x % tile_size ) * 3;
+        }
+    };
+
+    // levels[0] is the image, every further level half the size of the one
+    // before, down to 1x1
+    std::vector<Level> levels;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+
+    bool load( const std::string& filename ) {
+        std::cout << "Loading texture: " << filename << std::endl;
+        std::string full_path = "scenes/" + filename;
+
+        // Use STB to load the image
+        int file_channels;
+        unsigned char* loaded_data = stbi_load( full_path.c_str(), &width, &height, &file_channels, 3 );
+        if ( !loaded_data ) {
+            std::cout << "Failed to load texture: " << filename << " - using default color" << std::endl;
+            width = height = channels = 0;
+            return false;
+        }
+
+        std::cout << "Successfully loaded texture: " << filename << " (" << width << "x" << height << ", "
+                  << file_channels << " channels)" << std::endl;
+        channels = 3; // Force RGB
+        set_image( loaded_data, width, height );
+        stbi_image_free( loaded_data );
+        return true;
+    }
+
+    // Takes over an RGB image, rows top to bottom, and builds the mip chain
+    void set_image( const unsigned char* rgb, int image_width, int image_height ) {
+        width = image_width;
+        height = image_height;
+        levels.clear();
+        levels.push_back( make_level( width, height ) );
+        Level& base = levels[0];
+        for ( int y = 0; y < height; y++ ) {
+            // Here I copy each row in runs of one tile width
+            for ( int x = 0; x < width; x += tile_size ) {
+                int run = std::min( (int)tile_size, width - x );
+                std::memcpy( &base.texels[base.offset( x, y )], rgb + ( (size_t)y * width + x ) * 3, run * 3 );
+            }
+        }
+        while ( levels.back().width > 1 || levels.back().height > 1 ) {
+            levels.push_back( downsample( levels.back() ) );
+        }
+    }
+
+    // Linear colour at (u, v), with the coordinates wrapped for tiling, for
+    // a lookup footprint footprint wide in texture coordinates. Footprints
+    // up to one texel take the nearest texel of the full image; wider ones
+    // blend bilinear lookups in the two mip levels around the footprint.
+    // False for coordinates that are not finite.
+    bool sample( float u, float v, float footprint, Vec& color ) const {
+        if ( levels.empty() ) {
+            return false;
+        }
+
+        // Here I wrap the coordinates for tiling
+        u = u - floorf( u );
+        v = v - floorf( v );
+        if ( !( u >= 0.0f && u <= 1.0f && v >= 0.0f && v <= 1.0f ) ) {
+            return false;
+        }
+
+        float lod = footprint > 0.0f ? std::log2( footprint * std::sqrt( (float)width * height ) ) : 0.0f;
+        if ( !( lod > 0.0f ) ) {
+            color = nearest( levels[0], u, v );
+            return true;
+        }
+        lod = std::min( lod, (float)( levels.size() - 1 ) );
+        int level = (int)lod;
+        float blend = lod - level;
+        color = bilinear( levels[level], u, v );
+        if ( blend > 0.0f ) {
+            color = color * ( 1.0f - blend ) + bilinear( levels[level + 1], u, v ) * blend;
+        }
+        return true;
+    }
+
+    size_t memory_bytes() const {
+        size_t bytes = 0;
+        for ( const Level& level : levels ) {
+            bytes += level.texels.size();
+        }
+        return bytes;
+    }
+
+    // Linear value of every 8-bit sRGB value
+    static const float* linear_table() {
+        static const std::vector<float> table = [] {
+            std::vector<float> values( 256 );
+            for ( int i = 0; i < 256; i++ ) {
+                values[i] = srgb_to_linear( i / 255.0f );
+            }
+            return values;
+        }();
+        return table.data();
+    }
+
+private:
+    Vec texel( const Level& level, int x, int y ) const {
+        const unsigned char* rgb = &level.texels[level.offset( x, y )];
+        const float* table = linear_table();
+        return Vec( table[rgb[0]], table[rgb[1]], table[rgb[2]] );
+    }
+
+    // u and v in [0, 1]
+    Vec nearest( const Level& level, float u, float v ) const {
+        // Here I convert to texture pixel locations
+        int x = (int)( u * ( level.width - 1 ) );
+        int y = (int)( v * ( level.height - 1 ) );
+        return texel( level, x, y );
+    }
+
+    // Bilinear blend of the four texel centres around (u, v), wrapping
+    // around the edges
+    Vec bilinear( const Level& level, float u, float v ) const {
+        float x = u * level.width - 0.5f;
+        float y = v * level.height - 0.5f;
+        float fx = x - floorf( x );
+        float fy = y - floorf( y );
+        int x0 = ( (int)floorf( x ) + level.width ) % level.width;
+        int y0 = ( (int)floorf( y ) + level.height ) % level.height;
+        int x1 = ( x0 + 1 ) % level.width;
+        int y1 = ( y0 + 1 ) % level.height;
+        Vec top = texel( level, x0, y0 ) * ( 1.0f - fx ) + texel( level, x1, y0 ) * fx;
+        Vec bottom = texel( level, x0, y1 ) * ( 1.0f - fx ) + texel( level, x1, y1 ) * fx;
+        return top * ( 1.0f - fy ) + bottom * fy;
+    }
+
+    static Level make_level( int level_width, int level_height ) {
+        Level level;
+        level.width = level_width;
+        level.height = level_height;
+        level.tiles_x = ( level_width + tile_size - 1 ) / tile_size;
+        int tiles_y = ( level_height + tile_size - 1 ) / tile_size;
+        level.texels.assign( (size_t)level.tiles_x * tiles_y * tile_size * tile_size * 3, 0 );
+        return level;
+    }
+
+    // Half size level, every texel the average of up to 2x2 texels of the
+    // level above, averaged in linear space
+    static Level downsample( const Level& above ) {
+        Level level = make_level( std::max( 1, above.width / 2 ), std::max( 1, above.height / 2 ) );
+        const float* table = linear_table();
+        for ( int y = 0; y < level.height; y++ ) {
+            int y0 = std::min( y * 2, above.height - 1 );
+            int y1 = std::min( y * 2 + 1, above.height - 1 );
+            for ( int x = 0; x < level.width; x++ ) {
+                int x0 = std::min( x * 2, above.width - 1 );
+                int x1 = std::min( x * 2 + 1, above.width - 1 );
+                const unsigned char* a = &above.texels[above.offset( x0, y0 )];
+                const unsigned char* b = &above.texels[above.offset( x1, y0 )];
+                const unsigned char* c = &above.texels[above.offset( x0, y1 )];
+                const unsigned char* d = &above.texels[above.offset( x1, y1 )];
+                unsigned char* out = &level.texels[level.offset( x, y )];
+                for ( int k = 0; k < 3; k++ ) {
+                    out[k] = encode( 0.25f * ( table[a[k]] + table[b[k]] + table[c[k]] + table[d[k]] ) );
+                }
+            }
+        }
+        return level;
+    }
+
+    // Nearest 8-bit sRGB value of a linear value in [0, 1]
+    static unsigned char encode( float linear ) {
+        static const int steps = 4096;
+        // The lowest sRGB value whose linear value is at least i / steps; the
+        // nearest one is this or the one below
+        static const std::vector<unsigned char> guesses = [] {
+            const float* table = linear_table();
+            std::vector<unsigned char> values( steps + 1 );
+            for ( int i = 0; i <= steps; i++ ) {
+                int k = (int)( std::lower_bound( table, table + 256, (float)i / steps ) - table );
+                values[i] = (unsigned char)std::min( k, 255 );
+            }
+            return values;
+        }();
+        const float* table = linear_table();
+        int i = guesses[std::min( std::max( (int)( linear * steps ), 0 ), steps )];
+        // Values in between two steps can round to the next value up or down
+        while ( i < 255 && table[i] < linear ) {
+            i++;
+        }
+        if ( i > 0 && linear - table[i - 1] < table[i] - linear ) {
+            i--;
+        }
+        return (unsigned char)i;
+    }
+};
+
+class TextureCache;
+
+// A texture file that is only decoded on its first lookup, so textures no
+// ray ever hits cost nothing but their name. The decoded image of a texture
+// owned by a TextureCache counts against the cache's memory budget and may
+// be dropped between renders, to be decoded again when it is needed.
+class Texture {
+public:
+    explicit Texture( const std::string& filename, TextureCache* owner = nullptr )
+        : filename( filename ), image( nullptr ), failed( false ), last_used( 0 ), owner( owner ) { }
+
+    Texture( const Texture& ) = delete;
+    Texture& operator=( const Texture& ) = delete;
+
+    ~Texture() {
+        delete image.load();
+    }
+
+    // Linear colour at (u, v) for a lookup footprint wide in texture
+    // coordinates, see TextureImage::sample(). False if the file can't be
+    // loaded or the coordinates are not finite.
+    bool sample( float u, float v, float footprint, Vec& color ) const {
+        const TextureImage* current = image.load( std::memory_order_acquire );
+        if ( !current ) {
+            if ( failed.load( std::memory_order_relaxed ) ) {
+                return false;
+            }
+            current = decode();
+            if ( !current ) {
+                return false;
+            }
+        }
+        touch();
+        return current->sample( u, v, footprint, color );
+    }
+
+    const std::string filename;
+
+private:
+    friend class TextureCache;
+
+    const TextureImage* decode() const;
+    void touch() const;
+
+    // Frees the decoded image and returns its size; only while nothing samples
+    size_t unload() {
+        TextureImage* current = image.exchange( nullptr );
+        size_t bytes = current ? current->memory_bytes() : 0;
+        delete current;
+        return bytes;
+    }
+
+    mutable std::atomic<TextureImage*> image;
+    mutable std::mutex decode_mutex;
+    // Files that failed to load aren't tried again
+    mutable std::atomic<bool> failed;
+    // Render count of the owner when the texture was last sampled
+    mutable std::atomic<uint64_t> last_used;
+    TextureCache* owner;
+};
+
+// Textures by file name, so every material using the same file shares one
+// decoded copy. Safe to use from several threads: each file is decoded once,
+// by the first render thread sampling it, while other threads decode other
+// files. Decoded images beyond the memory budget are dropped least recently
+// used first, but only while no render is running, so lookups never wait for
+// a lock or find their image gone.
+class TextureCache {
+public:
+    TextureCache() : resident( 0 ), clock( 1 ), budget( 0 ), renders( 0 ) { }
+    TextureCache( const TextureCache& ) = delete;
+    TextureCache& operator=( const TextureCache& ) = delete;
+
+    // The cache scenes use unless they are given another one
+    static TextureCache& global() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // Never nullptr; the file isn't read until the texture is sampled
+    const Texture* get( const std::string& filename ) {
+        std::lock_guard<std::mutex> lock( mutex );
+        std::unique_ptr<Texture>& slot = entries[filename];
+        if ( !slot ) {
+            slot.reset( new Texture( filename, this ) );
+        }
+        return slot.get();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock( mutex );
+        return entries.size();
+    }
+
+    // Number of textures currently decoded
+    size_t decoded() {
+        std::lock_guard<std::mutex> lock( mutex );
+        size_t count = 0;
+        for ( const auto& entry : entries ) {
+            count += entry.second->image.load() != nullptr;
+        }
+        return count;
+    }
+
+    size_t resident_bytes() const {
+        return resident.load();
+    }
+
+    // Memory for decoded images in bytes, 0 for no limit
+    void set_budget( size_t bytes ) {
+        std::lock_guard<std::mutex> lock( mutex );
+        budget = bytes;
+        if ( renders == 0 ) {
+            trim();
+        }
+    }
+
+    // Renders sampling textures of this cache call these before and after
+    void begin_render() {
+        std::lock_guard<std::mutex> lock( mutex );
+        renders++;
+        clock++;
+    }
+
+    void end_render() {
+        std::lock_guard<std::mutex> lock( mutex );
+        if ( --renders == 0 ) {
+            trim();
+        }
+    }
+
+private:
+    friend class Texture;
+
+    // Drops decoded images, least recently used first, until the rest fits
+    // the budget. Called with the mutex held and no render running.
+    void trim() {
+        if ( budget == 0 || resident <= budget ) {
+            return;
+        }
+        std::vector<Texture*> loaded;
+        for ( const auto& entry : entries ) {
+            if ( entry.second->image.load() ) {
+                loaded.push_back( entry.second.get() );
+            }
+        }
+        std::sort( loaded.begin(), loaded.end(), []( const Texture* a, const Texture* b ) {
+            return a->last_used.load() < b->last_used.load();
+        } );
+        size_t dropped = 0;
+        for ( size_t i = 0; i < loaded.size() && resident > budget; i++ ) {
+            std::lock_guard<std::mutex> lock( loaded[i]->decode_mutex );
+            resident -= loaded[i]->unload();
+            dropped++;
+        }
+        std::cout << "Dropped " << dropped << " textures to stay within the texture budget (" << resident / 1024
+                  << " of " << budget / 1024 << " KB in use)" << std::endl;
+    }
+
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<Texture>> entries;
+    std::atomic<size_t> resident;
+    std::atomic<uint64_t> clock;
+    size_t budget;
+    int renders;
+};
+
+inline const TextureImage* Texture::decode() const {
+    std::lock_guard<std::mutex> lock( decode_mutex );
+    TextureImage* current = image.load();
+    if ( current || failed.load() ) {
+        return current;
+    }
+    current = new TextureImage();
+    if ( !current->load( filename ) ) {
+        delete current;
+        failed = true;
+        return nullptr;
+    }
+    if ( owner ) {
+        owner->resident += current->memory_bytes();
+    }
+    image.store( current, std::memory_order_release );
+    return current;
+}
+
+inline void Texture::touch() const {
+    // Here I only write the stamp once per render, so threads sampling the
+    // same texture don't keep taking the cache line from each other
+    if ( owner ) {
+        uint64_t now = owner->clock.load( std::memory_order_relaxed );
+        if ( last_used.load( std::memory_order_relaxed ) != now ) {
+            last_used.store( now, std::memory_order_relaxed );
+        }
+    }
+}
+
+#endif
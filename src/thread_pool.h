@@ -0,0 +1,218 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads with one task deque each. A worker takes new
+// work from the back of its own deque and, once that runs dry, steals from the
+// front of the others, so uneven tasks (cheap sky tiles next to expensive glass
+// tiles) still keep every core busy.
+class ThreadPool {
+public:
+    explicit ThreadPool( int thread_count = 0 ) : stopping( false ), queued( 0 ), next_queue( 0 ) {
+        if ( thread_count <= 0 ) {
+            thread_count = default_thread_count();
+        }
+        for ( int i = 0; i < thread_count; i++ ) {
+            queues.emplace_back( new WorkQueue() );
+        }
+        for ( int i = 0; i < thread_count; i++ ) {
+            workers.emplace_back( [this, i] { worker_loop( i ); } );
+        }
+    }
+
+    ThreadPool( const ThreadPool& ) = delete;
+    ThreadPool& operator=( const ThreadPool& ) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock( wake_mutex );
+            stopping = true;
+        }
+        wake.notify_all();
+        for ( std::thread& worker : workers ) {
+            worker.join();
+        }
+    }
+
+    static int default_thread_count() {
+        unsigned int n = std::thread::hardware_concurrency();
+        return n > 0 ? (int)n : 1;
+    }
+
+    int size() const {
+        return (int)workers.size();
+    }
+
+    void submit( std::function<void()> task ) {
+        int index = worker_index();
+        if ( index < 0 ) {
+            index = (int)( next_queue++ % queues.size() );
+        }
+        {
+            std::lock_guard<std::mutex> lock( queues[index]->mutex );
+            queues[index]->tasks.push_back( std::move( task ) );
+        }
+        queued++;
+        {
+            std::lock_guard<std::mutex> lock( wake_mutex );
+        }
+        wake.notify_one();
+    }
+
+    // Runs one queued task on the calling thread if there is any. Threads that
+    // wait for work to finish call this so they help instead of blocking.
+    bool run_one() {
+        std::function<void()> task;
+        if ( !take( worker_index(), task ) ) {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+    // Calls fn( i ) for every i in [0, count) on the pool and returns once all
+    // calls have finished
+    void parallel_for( int count, const std::function<void( int )>& fn );
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // Index of the calling thread in this pool, or -1 for outside threads
+    int worker_index() const {
+        return current_pool() == this ? current_index() : -1;
+    }
+
+    static const ThreadPool*& current_pool() {
+        static thread_local const ThreadPool* pool = nullptr;
+        return pool;
+    }
+
+    static int& current_index() {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    bool take( int self, std::function<void()>& task ) {
+        int count = (int)queues.size();
+        if ( self >= 0 ) {
+            WorkQueue& own = *queues[self];
+            std::lock_guard<std::mutex> lock( own.mutex );
+            if ( !own.tasks.empty() ) {
+                task = std::move( own.tasks.back() );
+                own.tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+
+        // Here I steal the oldest task of another queue
+        int start = self >= 0 ? self + 1 : 0;
+        for ( int i = 0; i < count; i++ ) {
+            WorkQueue& victim = *queues[( start + i ) % count];
+            std::lock_guard<std::mutex> lock( victim.mutex );
+            if ( !victim.tasks.empty() ) {
+                task = std::move( victim.tasks.front() );
+                victim.tasks.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop( int index ) {
+        current_pool() = this;
+        current_index() = index;
+
+        while ( true ) {
+            if ( run_one() ) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock( wake_mutex );
+            wake.wait( lock, [this] { return stopping || queued > 0; } );
+            if ( stopping && queued == 0 ) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    bool stopping;
+    std::atomic<int> queued;
+    std::atomic<unsigned int> next_queue;
+};
+
+// A set of tasks on a ThreadPool that can be waited for together. Waiting
+// threads run queued tasks in the meantime, so groups can be nested.
+class TaskGroup {
+public:
+    explicit TaskGroup( ThreadPool& pool ) : pool( pool ), pending( 0 ) { }
+    TaskGroup( const TaskGroup& ) = delete;
+    TaskGroup& operator=( const TaskGroup& ) = delete;
+
+    ~TaskGroup() {
+        wait();
+    }
+
+    void run( std::function<void()> task ) {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            pending++;
+        }
+        pool.submit( [this, task] {
+            task();
+            // Decrement under the lock: once wait() has seen zero under the
+            // same lock, no task touches the group any more
+            std::lock_guard<std::mutex> lock( mutex );
+            if ( --pending == 0 ) {
+                done.notify_all();
+            }
+        } );
+    }
+
+    void wait() {
+        while ( true ) {
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                if ( pending == 0 ) {
+                    return;
+                }
+            }
+            if ( !pool.run_one() ) {
+                std::unique_lock<std::mutex> lock( mutex );
+                done.wait_for( lock, std::chrono::milliseconds( 1 ), [this] { return pending == 0; } );
+            }
+        }
+    }
+
+private:
+    ThreadPool& pool;
+    std::mutex mutex;
+    std::condition_variable done;
+    int pending;
+};
+
+inline void ThreadPool::parallel_for( int count, const std::function<void( int )>& fn ) {
+    TaskGroup group( *this );
+    for ( int i = 0; i < count; i++ ) {
+        group.run( [&fn, i] { fn( i ); } );
+    }
+    group.wait();
+}
+
+#endif
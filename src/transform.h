@@ -5,6 +5,8 @@
 #include "mat4.h"
 #include "ray.h"
 #include "hit.h"
+#include "aabb.h"
+#include <cmath>
 
 class Transform {
 public:
@@ -65,6 +67,28 @@ public:
         return transformed;
     }
 
+    // World-space box around a local-space box: the bounds of its eight
+    // transformed corners
+    AABB transform_bounds(const AABB& local) const {
+        AABB result;
+        for (int i = 0; i < 8; i++) {
+            Vec corner((i & 1) ? local.max.x : local.min.x,
+                       (i & 2) ? local.max.y : local.min.y,
+                       (i & 4) ? local.max.z : local.min.z);
+            result.expand(transform_point(corner));
+        }
+        return result;
+    }
+
+    // Factor the transform scales small areas by on a surface with the given
+    // (unit) local normal
+    float area_scale(const Vec& local_normal) const {
+        Vec helper = std::abs(local_normal.x) > 0.9f ? Vec(0, 1, 0) : Vec(1, 0, 0);
+        Vec t1 = Vec::cross(local_normal, helper).normalize();
+        Vec t2 = Vec::cross(local_normal, t1);
+        return Vec::cross(transform_direction(t1), transform_direction(t2)).length();
+    }
+
     Vec get_scale() const {
         return m.get_scale();
     }
@@ -0,0 +1,219 @@
+#ifndef TRIANGLE_SIMD_H
+#define TRIANGLE_SIMD_H
+
+#include "vec.h"
+#include "ray.h"
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TRIANGLE_PACKET_AVX2 1
+#define TRIANGLE_PACKET_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define TRIANGLE_PACKET_SSE2 1
+#define TRIANGLE_PACKET_WIDTH 4
+#else
+#define TRIANGLE_PACKET_WIDTH 4
+#endif
+
+// Moller-Trumbore data for TRIANGLE_PACKET_WIDTH triangles, one per lane.
+// Unused lanes have zero edges, which the determinant test always rejects,
+// and prim set to no_prim.
+struct alignas( 32 ) TrianglePacket {
+    static const int width = TRIANGLE_PACKET_WIDTH;
+    static const uint32_t no_prim = 0xFFFFFFFFu;
+
+    float v0x[width], v0y[width], v0z[width];
+    float e1x[width], e1y[width], e1z[width];
+    float e2x[width], e2y[width], e2z[width];
+    uint32_t prim[width];
+
+    void clear() {
+        for ( int i = 0; i < width; i++ ) {
+            v0x[i] = v0y[i] = v0z[i] = 0.0f;
+            e1x[i] = e1y[i] = e1z[i] = 0.0f;
+            e2x[i] = e2y[i] = e2z[i] = 0.0f;
+            prim[i] = no_prim;
+        }
+    }
+
+    void set( int lane, const Vec& v0, const Vec& edge1, const Vec& edge2, uint32_t prim_index ) {
+        v0x[lane] = v0.x; v0y[lane] = v0.y; v0z[lane] = v0.z;
+        e1x[lane] = edge1.x; e1y[lane] = edge1.y; e1z[lane] = edge1.z;
+        e2x[lane] = edge2.x; e2y[lane] = edge2.y; e2z[lane] = edge2.z;
+        prim[lane] = prim_index;
+    }
+
+    Vec edge1( int lane ) const { return Vec( e1x[lane], e1y[lane], e1z[lane] ); }
+    Vec edge2( int lane ) const { return Vec( e2x[lane], e2y[lane], e2z[lane] ); }
+};
+
+// Scalar Moller-Trumbore on one lane. The SIMD kernels below perform exactly
+// these operations in the same order, so both produce bit-identical t, u, v.
+inline bool intersect_triangle_lane( const TrianglePacket& packet, int lane, const Ray& ray, float& t, float& u, float& v ) {
+    Vec v0( packet.v0x[lane], packet.v0y[lane], packet.v0z[lane] );
+    Vec edge1 = packet.edge1( lane );
+    Vec edge2 = packet.edge2( lane );
+
+    Vec h = Vec::cross( ray.direction, edge2 );
+    float a = Vec::dot( edge1, h );
+    if ( a > -0.001f && a < 0.001f ) {
+        return false;
+    }
+
+    float f = 1.0 / a;
+    Vec s = ray.origin - v0;
+    u = f * Vec::dot( s, h );
+    if ( u < 0.0 || u > 1.0 ) {
+        return false;
+    }
+
+    Vec q = Vec::cross( s, edge1 );
+    v = f * Vec::dot( ray.direction, q );
+    if ( v < 0.0 || u + v > 1.0 ) {
+        return false;
+    }
+
+    t = f * Vec::dot( edge2, q );
+    return t > 0.001f;
+}
+
+inline int intersect_packet_scalar( const TrianglePacket& packet, const Ray& ray, float* t, float* u, float* v ) {
+    int mask = 0;
+    for ( int lane = 0; lane < TrianglePacket::width; lane++ ) {
+        if ( intersect_triangle_lane( packet, lane, ray, t[lane], u[lane], v[lane] ) ) {
+            mask |= 1 << lane;
+        }
+    }
+    return mask;
+}
+
+#if defined(TRIANGLE_PACKET_AVX2)
+
+struct PacketRay {
+    __m256 ox, oy, oz, dx, dy, dz;
+
+    explicit PacketRay( const Ray& ray ) :
+        ox( _mm256_set1_ps( ray.origin.x ) ), oy( _mm256_set1_ps( ray.origin.y ) ), oz( _mm256_set1_ps( ray.origin.z ) ),
+        dx( _mm256_set1_ps( ray.direction.x ) ), dy( _mm256_set1_ps( ray.direction.y ) ), dz( _mm256_set1_ps( ray.direction.z ) ) { }
+};
+
+// One ray against all eight lanes. Returns a bit mask of the lanes that hit
+// and writes their t, u, v.
+inline int intersect_packet( const TrianglePacket& p, const PacketRay& r, float* t_out, float* u_out, float* v_out ) {
+    __m256 e1x = _mm256_load_ps( p.e1x ), e1y = _mm256_load_ps( p.e1y ), e1z = _mm256_load_ps( p.e1z );
+    __m256 e2x = _mm256_load_ps( p.e2x ), e2y = _mm256_load_ps( p.e2y ), e2z = _mm256_load_ps( p.e2z );
+
+    __m256 hx = _mm256_sub_ps( _mm256_mul_ps( r.dy, e2z ), _mm256_mul_ps( r.dz, e2y ) );
+    __m256 hy = _mm256_sub_ps( _mm256_mul_ps( r.dz, e2x ), _mm256_mul_ps( r.dx, e2z ) );
+    __m256 hz = _mm256_sub_ps( _mm256_mul_ps( r.dx, e2y ), _mm256_mul_ps( r.dy, e2x ) );
+    __m256 a = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e1x, hx ), _mm256_mul_ps( e1y, hy ) ), _mm256_mul_ps( e1z, hz ) );
+
+    __m256 eps = _mm256_set1_ps( 0.001f );
+    __m256 parallel = _mm256_and_ps( _mm256_cmp_ps( a, _mm256_sub_ps( _mm256_setzero_ps(), eps ), _CMP_GT_OQ ),
+                                     _mm256_cmp_ps( a, eps, _CMP_LT_OQ ) );
+
+    // The scalar code divides in double precision, so do the same here
+    __m256d one = _mm256_set1_pd( 1.0 );
+    __m128 f_lo = _mm256_cvtpd_ps( _mm256_div_pd( one, _mm256_cvtps_pd( _mm256_castps256_ps128( a ) ) ) );
+    __m128 f_hi = _mm256_cvtpd_ps( _mm256_div_pd( one, _mm256_cvtps_pd( _mm256_extractf128_ps( a, 1 ) ) ) );
+    __m256 f = _mm256_insertf128_ps( _mm256_castps128_ps256( f_lo ), f_hi, 1 );
+
+    __m256 sx = _mm256_sub_ps( r.ox, _mm256_load_ps( p.v0x ) );
+    __m256 sy = _mm256_sub_ps( r.oy, _mm256_load_ps( p.v0y ) );
+    __m256 sz = _mm256_sub_ps( r.oz, _mm256_load_ps( p.v0z ) );
+    __m256 u = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( sx, hx ), _mm256_mul_ps( sy, hy ) ), _mm256_mul_ps( sz, hz ) ) );
+
+    __m256 qx = _mm256_sub_ps( _mm256_mul_ps( sy, e1z ), _mm256_mul_ps( sz, e1y ) );
+    __m256 qy = _mm256_sub_ps( _mm256_mul_ps( sz, e1x ), _mm256_mul_ps( sx, e1z ) );
+    __m256 qz = _mm256_sub_ps( _mm256_mul_ps( sx, e1y ), _mm256_mul_ps( sy, e1x ) );
+    __m256 v = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( r.dx, qx ), _mm256_mul_ps( r.dy, qy ) ), _mm256_mul_ps( r.dz, qz ) ) );
+    __m256 t = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e2x, qx ), _mm256_mul_ps( e2y, qy ) ), _mm256_mul_ps( e2z, qz ) ) );
+
+    // Written as "accept" conditions so NaNs fail like they do in the scalar code
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one_f = _mm256_set1_ps( 1.0f );
+    __m256 ok = _mm256_andnot_ps( parallel, _mm256_cmp_ps( u, zero, _CMP_NLT_UQ ) );
+    ok = _mm256_and_ps( ok, _mm256_cmp_ps( u, one_f, _CMP_NGT_UQ ) );
+    ok = _mm256_and_ps( ok, _mm256_cmp_ps( v, zero, _CMP_NLT_UQ ) );
+    ok = _mm256_and_ps( ok, _mm256_cmp_ps( _mm256_add_ps( u, v ), one_f, _CMP_NGT_UQ ) );
+    ok = _mm256_and_ps( ok, _mm256_cmp_ps( t, eps, _CMP_GT_OQ ) );
+
+    _mm256_storeu_ps( t_out, t );
+    _mm256_storeu_ps( u_out, u );
+    _mm256_storeu_ps( v_out, v );
+    return _mm256_movemask_ps( ok );
+}
+
+#elif defined(TRIANGLE_PACKET_SSE2)
+
+struct PacketRay {
+    __m128 ox, oy, oz, dx, dy, dz;
+
+    explicit PacketRay( const Ray& ray ) :
+        ox( _mm_set1_ps( ray.origin.x ) ), oy( _mm_set1_ps( ray.origin.y ) ), oz( _mm_set1_ps( ray.origin.z ) ),
+        dx( _mm_set1_ps( ray.direction.x ) ), dy( _mm_set1_ps( ray.direction.y ) ), dz( _mm_set1_ps( ray.direction.z ) ) { }
+};
+
+// One ray against all four lanes. Returns a bit mask of the lanes that hit
+// and writes their t, u, v.
+inline int intersect_packet( const TrianglePacket& p, const PacketRay& r, float* t_out, float* u_out, float* v_out ) {
+    __m128 e1x = _mm_load_ps( p.e1x ), e1y = _mm_load_ps( p.e1y ), e1z = _mm_load_ps( p.e1z );
+    __m128 e2x = _mm_load_ps( p.e2x ), e2y = _mm_load_ps( p.e2y ), e2z = _mm_load_ps( p.e2z );
+
+    __m128 hx = _mm_sub_ps( _mm_mul_ps( r.dy, e2z ), _mm_mul_ps( r.dz, e2y ) );
+    __m128 hy = _mm_sub_ps( _mm_mul_ps( r.dz, e2x ), _mm_mul_ps( r.dx, e2z ) );
+    __m128 hz = _mm_sub_ps( _mm_mul_ps( r.dx, e2y ), _mm_mul_ps( r.dy, e2x ) );
+    __m128 a = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, hx ), _mm_mul_ps( e1y, hy ) ), _mm_mul_ps( e1z, hz ) );
+
+    __m128 eps = _mm_set1_ps( 0.001f );
+    __m128 parallel = _mm_and_ps( _mm_cmpgt_ps( a, _mm_sub_ps( _mm_setzero_ps(), eps ) ), _mm_cmplt_ps( a, eps ) );
+
+    // The scalar code divides in double precision, so do the same here
+    __m128d one = _mm_set1_pd( 1.0 );
+    __m128 f_lo = _mm_cvtpd_ps( _mm_div_pd( one, _mm_cvtps_pd( a ) ) );
+    __m128 f_hi = _mm_cvtpd_ps( _mm_div_pd( one, _mm_cvtps_pd( _mm_movehl_ps( a, a ) ) ) );
+    __m128 f = _mm_movelh_ps( f_lo, f_hi );
+
+    __m128 sx = _mm_sub_ps( r.ox, _mm_load_ps( p.v0x ) );
+    __m128 sy = _mm_sub_ps( r.oy, _mm_load_ps( p.v0y ) );
+    __m128 sz = _mm_sub_ps( r.oz, _mm_load_ps( p.v0z ) );
+    __m128 u = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, hx ), _mm_mul_ps( sy, hy ) ), _mm_mul_ps( sz, hz ) ) );
+
+    __m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+    __m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+    __m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+    __m128 v = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( r.dx, qx ), _mm_mul_ps( r.dy, qy ) ), _mm_mul_ps( r.dz, qz ) ) );
+    __m128 t = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ) );
+
+    // Written as "accept" conditions so NaNs fail like they do in the scalar code
+    __m128 zero = _mm_setzero_ps();
+    __m128 one_f = _mm_set1_ps( 1.0f );
+    __m128 ok = _mm_andnot_ps( parallel, _mm_cmpnlt_ps( u, zero ) );
+    ok = _mm_and_ps( ok, _mm_cmpngt_ps( u, one_f ) );
+    ok = _mm_and_ps( ok, _mm_cmpnlt_ps( v, zero ) );
+    ok = _mm_and_ps( ok, _mm_cmpngt_ps( _mm_add_ps( u, v ), one_f ) );
+    ok = _mm_and_ps( ok, _mm_cmpgt_ps( t, eps ) );
+
+    _mm_storeu_ps( t_out, t );
+    _mm_storeu_ps( u_out, u );
+    _mm_storeu_ps( v_out, v );
+    return _mm_movemask_ps( ok );
+}
+
+#else
+
+struct PacketRay {
+    Ray ray;
+
+    explicit PacketRay( const Ray& ray ) : ray( ray ) { }
+};
+
+inline int intersect_packet( const TrianglePacket& p, const PacketRay& r, float* t_out, float* u_out, float* v_out ) {
+    return intersect_packet_scalar( p, r.ray, t_out, u_out, v_out );
+}
+
+#endif
+
+#endif
@@ -0,0 +1,98 @@
+// Checks that LBVH hierarchies, with and without treelet restructuring, keep
+// the layout the rest of the code relies on: they must load through
+// BVH::view() the way a .rtmesh cache file is read back, and refitting them
+// must give every node a box around all of its primitives.
+#include "bvh.h"
+#include "thread_pool.h"
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static std::mt19937 rng( 4242 );
+
+static float uniform( float lo, float hi ) {
+    return std::uniform_real_distribution<float>( lo, hi )( rng );
+}
+
+static AABB random_box( float spread ) {
+    Vec center( uniform( -spread, spread ), uniform( -spread, spread ), uniform( -spread, spread ) );
+    Vec half( uniform( 0.0f, 0.05f ), uniform( 0.0f, 0.05f ), uniform( 0.0f, 0.05f ) );
+    return AABB( center - half, center + half );
+}
+
+static bool contains( const AABB& outer, const AABB& inner ) {
+    return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z &&
+           outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+}
+
+// Every node's box holds the boxes of all primitives below it
+static bool check_bounds( const BVH& bvh, const std::vector<AABB>& prim_bounds, uint32_t index ) {
+    const BVHNode& node = bvh.nodes.data()[index];
+    if ( node.is_leaf() ) {
+        for ( uint32_t k = node.left_first; k < node.left_first + node.count; k++ ) {
+            if ( !contains( node.bounds, prim_bounds[bvh.prim_indices.data()[k]] ) ) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return contains( node.bounds, bvh.nodes.data()[node.left_first].bounds ) &&
+           contains( node.bounds, bvh.nodes.data()[node.left_first + 1].bounds ) &&
+           check_bounds( bvh, prim_bounds, node.left_first ) && check_bounds( bvh, prim_bounds, node.left_first + 1 );
+}
+
+static bool check( const char* name, std::vector<AABB> prim_bounds, int treelet_passes, ThreadPool& pool ) {
+    BVH bvh;
+    bvh.build_lbvh( prim_bounds, &pool, 4, 1, treelet_passes );
+
+    // Here I read the arrays back the way a cache file is mapped
+    std::vector<BVHNode> node_copy( bvh.nodes.data(), bvh.nodes.data() + bvh.nodes.size() );
+    std::vector<uint32_t> index_copy( bvh.prim_indices.data(), bvh.prim_indices.data() + bvh.prim_indices.size() );
+    BVH loaded;
+    if ( !loaded.view( node_copy.data(), node_copy.size(), index_copy.data(), index_copy.size() ) ) {
+        std::printf( "%s, %d treelet passes: view() rejects the built hierarchy\n", name, treelet_passes );
+        return false;
+    }
+
+    // Move every primitive a little and refit
+    for ( AABB& box : prim_bounds ) {
+        Vec shift( uniform( -0.2f, 0.2f ), uniform( -0.2f, 0.2f ), uniform( -0.2f, 0.2f ) );
+        box = AABB( box.min + shift, box.max + shift );
+    }
+    if ( !bvh.refit( prim_bounds ) || !check_bounds( bvh, prim_bounds, 0 ) ) {
+        std::printf( "%s, %d treelet passes: refit boxes don't hold their primitives\n", name, treelet_passes );
+        return false;
+    }
+    std::printf( "%s, %d treelet passes: %zu nodes, SAH cost %g\n", name, treelet_passes, bvh.nodes.size(),
+                 bvh.sah_cost() );
+    return true;
+}
+
+int main() {
+    ThreadPool pool( 4 );
+    bool ok = true;
+
+    std::vector<AABB> scattered( 20000 );
+    for ( AABB& box : scattered ) {
+        box = random_box( 10.0f );
+    }
+
+    // Clusters at exponentially shrinking scales give a very deep LBVH, which
+    // restructuring must not push past max_depth
+    std::vector<AABB> nested;
+    for ( int level = 0; level < 40; level++ ) {
+        float scale = std::ldexp( 1.0f, -level / 2 );
+        for ( int i = 0; i < 8; i++ ) {
+            Vec center( uniform( 0.0f, scale ), uniform( 0.0f, scale ), uniform( 0.0f, scale ) );
+            Vec half( scale * 0.01f, scale * 0.01f, scale * 0.01f );
+            nested.push_back( AABB( center - half, center + half ) );
+        }
+    }
+
+    for ( int passes = 0; passes <= 3; passes++ ) {
+        ok = check( "scattered", scattered, passes, pool ) && ok;
+        ok = check( "nested", nested, passes, pool ) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+// Checks that the SIMD packet kernel in triangle_simd.h gives exactly the
+// scalar kernel's results: the same hit mask, and bit-identical t, u, v for
+// every lane that hits. Built once for the default instruction set and, where
+// the compiler can, once more with AVX2.
+#include "triangle_simd.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+
+#if defined(TRIANGLE_PACKET_AVX2) && ( defined(__GNUC__) || defined(__clang__) )
+#define CHECK_AVX2_SUPPORT 1
+#endif
+
+static std::mt19937 rng( 12345 );
+
+static float uniform( float lo, float hi ) {
+    return std::uniform_real_distribution<float>( lo, hi )( rng );
+}
+
+static Vec random_vec( float lo, float hi ) {
+    return Vec( uniform( lo, hi ), uniform( lo, hi ), uniform( lo, hi ) );
+}
+
+// Kinds of lane the packets are filled with
+enum LaneKind {
+    NORMAL,
+    SLIVER,      // very thin, close to the determinant cutoff
+    DEGENERATE,  // zero or collinear edges
+    EDGE_ON,     // plane contains the ray direction
+    NAN_LANE,    // NaN in a vertex or an edge
+    INF_LANE,    // infinite vertex
+    EMPTY,       // cleared lane
+    KIND_COUNT
+};
+
+static void fill_lane( TrianglePacket& packet, int lane, LaneKind kind, const Ray& ray ) {
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    const float inf = std::numeric_limits<float>::infinity();
+    Vec v0 = random_vec( -1.0f, 1.0f );
+    Vec e1 = random_vec( -1.0f, 1.0f );
+    Vec e2 = random_vec( -1.0f, 1.0f );
+    switch ( kind ) {
+    case NORMAL:
+        break;
+    case SLIVER:
+        e2 = e1 * uniform( -2.0f, 2.0f ) + random_vec( -0.01f, 0.01f );
+        break;
+    case DEGENERATE:
+        if ( rng() % 2 ) {
+            e1 = Vec( 0, 0, 0 );
+        } else {
+            e2 = e1 * uniform( -2.0f, 2.0f );
+        }
+        break;
+    case EDGE_ON:
+        e2 = ray.direction * uniform( 0.1f, 2.0f ) + e1 * uniform( -1.0f, 1.0f );
+        v0 = ray.origin + ray.direction * uniform( 0.5f, 2.0f ) - e1 * uniform( 0.0f, 0.5f );
+        break;
+    case NAN_LANE:
+        ( rng() % 2 ? v0.y : e2.z ) = nan;
+        break;
+    case INF_LANE:
+        v0.x = rng() % 2 ? inf : -inf;
+        break;
+    default:
+        return;
+    }
+    packet.set( lane, v0, e1, e2, (uint32_t)lane );
+}
+
+// A ray from a random origin towards a point near the triangle (v0, e1, e2),
+// often just outside an edge, or a broken ray every so often
+static Ray random_ray( int index, const Vec& v0, const Vec& e1, const Vec& e2 ) {
+    Vec origin = random_vec( -2.0f, 2.0f );
+    float u = uniform( -0.05f, 1.05f );
+    float v = uniform( -0.05f, 1.05f - u );
+    Vec direction = v0 + e1 * u + e2 * v - origin;
+    if ( index % 97 == 0 ) {
+        direction.x = std::numeric_limits<float>::quiet_NaN();
+    } else if ( index % 89 == 0 ) {
+        origin.z = std::numeric_limits<float>::quiet_NaN();
+    } else if ( index % 83 == 0 ) {
+        direction = Vec( 0, 0, 0 );
+    }
+    return Ray( origin, direction );
+}
+
+int main() {
+#if defined(CHECK_AVX2_SUPPORT)
+    if ( !__builtin_cpu_supports( "avx2" ) ) {
+        std::printf( "CPU has no AVX2, skipping\n" );
+        return 77;
+    }
+#endif
+
+    const int rounds = 200000;
+    int hits = 0;
+    int hits_by_kind[KIND_COUNT] = {};
+    int failures = 0;
+    for ( int round = 0; round < rounds && failures < 10; round++ ) {
+        // Here I aim the ray at one lane and fill the others at random
+        Vec v0 = random_vec( -1.0f, 1.0f );
+        Vec e1 = random_vec( -1.0f, 1.0f );
+        Vec e2 = random_vec( -1.0f, 1.0f );
+        Ray ray = random_ray( round, v0, e1, e2 );
+        int target = (int)( rng() % TrianglePacket::width );
+        TrianglePacket packet;
+        packet.clear();
+        LaneKind kinds[TrianglePacket::width];
+        for ( int lane = 0; lane < TrianglePacket::width; lane++ ) {
+            kinds[lane] = rng() % 2 ? NORMAL : (LaneKind)( rng() % KIND_COUNT );
+            fill_lane( packet, lane, kinds[lane], ray );
+        }
+        kinds[target] = NORMAL;
+        packet.set( target, v0, e1, e2, (uint32_t)target );
+
+        float t_scalar[TrianglePacket::width] = {}, u_scalar[TrianglePacket::width] = {}, v_scalar[TrianglePacket::width] = {};
+        float t_simd[TrianglePacket::width] = {}, u_simd[TrianglePacket::width] = {}, v_simd[TrianglePacket::width] = {};
+        int mask_scalar = intersect_packet_scalar( packet, ray, t_scalar, u_scalar, v_scalar );
+        int mask_simd = intersect_packet( packet, PacketRay( ray ), t_simd, u_simd, v_simd );
+
+        // Here I compare the lanes that hit bit for bit; missing lanes may hold
+        // anything
+        bool same = mask_scalar == mask_simd;
+        for ( int lane = 0; same && lane < TrianglePacket::width; lane++ ) {
+            if ( mask_scalar & ( 1 << lane ) ) {
+                same = std::memcmp( &t_scalar[lane], &t_simd[lane], sizeof( float ) ) == 0 &&
+                       std::memcmp( &u_scalar[lane], &u_simd[lane], sizeof( float ) ) == 0 &&
+                       std::memcmp( &v_scalar[lane], &v_simd[lane], sizeof( float ) ) == 0;
+                hits++;
+                hits_by_kind[kinds[lane]]++;
+            }
+        }
+        if ( !same ) {
+            failures++;
+            std::printf( "round %d: scalar mask %x, simd mask %x\n", round, mask_scalar, mask_simd );
+            for ( int lane = 0; lane < TrianglePacket::width; lane++ ) {
+                std::printf( "  lane %d kind %d: scalar t=%.9g u=%.9g v=%.9g, simd t=%.9g u=%.9g v=%.9g\n", lane,
+                             (int)kinds[lane], t_scalar[lane], u_scalar[lane], v_scalar[lane], t_simd[lane], u_simd[lane],
+                             v_simd[lane] );
+            }
+        }
+    }
+
+    std::printf( "%d-wide packets: %d rounds, %d lane hits (%d sliver, %d edge-on), %d mismatches\n",
+                 TrianglePacket::width, rounds, hits, hits_by_kind[SLIVER], hits_by_kind[EDGE_ON], failures );
+    // A run without hits would compare nothing
+    if ( hits < rounds / 2 ) {
+        std::printf( "too few hits\n" );
+        return 1;
+    }
+    return failures == 0 ? 0 : 1;
+}